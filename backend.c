@@ -0,0 +1,63 @@
+/* See LICENSE file for copyright and license details. */
+
+#include "pulseaudio.h"
+#include "sinks.h"
+
+static const AudioBackend *backend = &pulse_backend;
+
+void use_backend(const AudioBackend *b) {
+    backend = b;
+}
+
+int setup_pulse(int fetch_delay_ms) {
+    return backend->setup(fetch_delay_ms);
+}
+
+int free_pulse() {
+    return backend->free();
+}
+
+void set_volume(const PulseSink *sink, pa_volume_t volume) {
+    backend->set_volume(sink, volume);
+}
+
+void set_mute(const PulseSink *sink, uint8_t mute) {
+    backend->set_mute(sink, mute);
+}
+
+void set_default_sink(const PulseSink *sink) {
+    backend->set_default_sink(sink);
+}
+
+int wait_for_pulse(int timeout_ms) {
+    return backend->wait_ready(timeout_ms);
+}
+
+int wait_for_ops() {
+    return backend->wait_ops();
+}
+
+const PulseSink *get_default_sink() {
+    return backend->default_sink();
+}
+
+/* Lock-free, for the ui thread only. Every backend publishes through sinks.c */
+const PulseState *get_state() {
+    return sinks_state();
+}
+
+void pulse_lock() {
+    backend->lock();
+}
+
+void pulse_unlock() {
+    backend->unlock();
+}
+
+const PulseStats *get_pulse_stats() {
+    return backend->stats();
+}
+
+int get_pulse_fd() {
+    return backend->fd();
+}
@@ -0,0 +1,243 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Microbenchmarks of the hot paths, run with make bench. Sinks come from the
+ * mock backend and frames are drawn by the software renderer, see headless.h,
+ * so neither X nor pulseaudio is needed.
+ *
+ *   daudio-bench [-t ms] [prefix]
+ *
+ * runs every benchmark whose name starts with prefix for at least ms
+ * milliseconds and prints one line per benchmark:
+ *
+ *   bench name=draw/full/10 n=4096 ns/op=5123.4 allocs/op=0.00
+ *
+ * allocs/op counts malloc, calloc and realloc calls of all threads. */
+
+#include "headless.h"
+#include "sinks.h"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long allocs;
+static int min_ms = 200;
+static const char *prefix = "";
+
+void *
+malloc(size_t size)
+{
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+void
+free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+/* Runs op(arg) in doubling batches until one batch takes min_ms. */
+static void
+bench(const char *name, void (*op)(int), int arg)
+{
+	struct timespec start, end, d;
+	unsigned long n, i, a;
+	double ns;
+
+	if (strncmp(name, prefix, strlen(prefix)))
+		return;
+	for (n = 1;; n *= 2) {
+		a = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < n; i++)
+			op(arg);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		a = __atomic_load_n(&allocs, __ATOMIC_RELAXED) - a;
+		timespec_diff(&d, &end, &start);
+		ns = d.tv_sec * 1e9 + d.tv_nsec;
+		if (ns >= min_ms * 1e6 || n >= 1ul << 30)
+			break;
+	}
+	printf("bench name=%s n=%lu ns/op=%.1f allocs/op=%.2f\n", name, n, ns / n, (double)a / n);
+	fflush(stdout);
+}
+
+static void
+bench_n(const char *fmt, void (*op)(int), int arg)
+{
+	char name[64];
+
+	snprintf(name, sizeof(name), fmt, arg);
+	bench(name, op, arg);
+}
+
+/* sink table, filled with sinks 0 to n - 1 */
+
+static void
+fill_sinks(int n)
+{
+	char name[32];
+	SinkHandle h;
+
+	sinks_free();
+	for (int i = 0; i < n; i++) {
+		h = sinks_add(i);
+		snprintf(name, sizeof(name), "bench.sink%d", i);
+		sinks_set_name(h, name);
+	}
+}
+
+static void
+op_add_remove(int n)
+{
+	sinks_remove(sinks_add(n));
+}
+
+static void
+op_find(int n)
+{
+	static unsigned int i;
+
+	if (!sinks_find(i++ % n))
+		die("sink missing");
+}
+
+static void
+op_find_name(int n)
+{
+	static unsigned int i;
+	char name[32];
+
+	snprintf(name, sizeof(name), "bench.sink%u", i++ % n);
+	if (!sinks_find_name(name))
+		die("sink missing");
+}
+
+static void
+op_publish(int n)
+{
+	sinks_publish(0);
+}
+
+/* text */
+
+static const char *texts[] = {
+	"Built-in Audio Analog Stereo",
+	"USB Audio Device - Headphones with a really long name that does not fit "
+	"into the row at all, Digital Stereo (IEC958) Output on the rear panel",
+	"Kopfhörer 🎧 ヘッドホン 耳机 헤드폰",
+};
+
+static void
+op_text(int i)
+{
+	drw_text(drw, bh, 0, mw - bh, bh, lrpad / 2, texts[i], 0);
+}
+
+static void
+op_text_layout(int i)
+{
+	drw_text_invalidate(drw, texts[i]);
+	drw_text(drw, bh, 0, mw - bh, bh, lrpad / 2, texts[i], 0);
+}
+
+/* volume and frames, on the mock backend */
+
+static void
+use_sinks(int n)
+{
+	free_pulse();
+	mock_configure(n, 0);
+	setup_pulse(0);
+	wait_for_default_sink();
+	update_selected_sink();
+	painted = 0;
+	draw();
+}
+
+static void
+op_change_volume(int steps)
+{
+	pulse_lock();
+	hold_volume_key(steps);
+	pulse_unlock();
+}
+
+static void
+op_draw_full(int n)
+{
+	painted = 0;
+	draw();
+}
+
+static void
+op_draw_volume(int n)
+{
+	op_change_volume(1);
+	draw();
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const int counts[] = { 1, 10, 100, 1000 };
+	size_t i;
+	int j;
+
+	for (j = 1; j < argc; j++) {
+		if (!strcmp(argv[j], "-t") && j + 1 < argc)
+			min_ms = atoi(argv[++j]);
+		else if (argv[j][0] == '-')
+			die("usage: daudio-bench [-t ms] [prefix]");
+		else
+			prefix = argv[j];
+	}
+
+	for (i = 0; i < LENGTH(counts); i++) {
+		fill_sinks(counts[i]);
+		bench_n("sinks_add_remove/%d", op_add_remove, counts[i]);
+		bench_n("sinks_find/%d", op_find, counts[i]);
+		bench_n("sinks_find_name/%d", op_find_name, counts[i]);
+		bench_n("sinks_publish/%d", op_publish, counts[i]);
+	}
+	sinks_free();
+
+	headless_setup();
+
+	bench("drw_text/ascii", op_text, 0);
+	bench("drw_text/truncated", op_text, 1);
+	bench("drw_text/fallback", op_text, 2);
+	bench("drw_text_layout/ascii", op_text_layout, 0);
+	bench("drw_text_layout/truncated", op_text_layout, 1);
+	bench("drw_text_layout/fallback", op_text_layout, 2);
+
+	use_backend(&mock_backend);
+	for (i = 0; i < LENGTH(counts); i++) {
+		use_sinks(counts[i]);
+		if (i == 0) {
+			bench_n("change_volume/%d", op_change_volume, 1);
+			bench_n("change_volume/%d", op_change_volume, 10);
+		}
+		bench_n("draw/full/%d", op_draw_full, counts[i]);
+		bench_n("draw/volume/%d", op_draw_volume, counts[i]);
+	}
+
+	headless_cleanup();
+	return 0;
+}
@@ -15,9 +15,31 @@ static const char *colors[SchemeLast][3] = {
 static int width = 400;
 static int height = 150;
 
-static int interval = 33;
 static int lifetime = 2500;
 
 static int minVol = 9;
 static int maxVol = 100;
 static int step = 3;
+
+/* ms to collect sink change events before fetching the sink info */
+static int sink_fetch_delay = 10;
+
+/* ms to wait for the initial sink list from pulseaudio before giving up */
+static int ready_timeout = 2000;
+
+/* sinks shown at once in interactive mode, the list scrolls beyond that */
+static int max_rows = 10;
+
+/* ms the -mock backend takes to answer an operation or injected event */
+static int mock_latency = 1;
+
+/* keep resolved fonts in $XDG_CACHE_HOME/daudio/fonts to skip fontconfig matching on start */
+static int font_cache = 0;
+
+/* grabbed on the root window with -g and handled without spawning anything */
+static const Key media_keys[] = {
+        /* modifier  key                       command */
+        { 0,         XF86XK_AudioRaiseVolume,  CtlInc },
+        { 0,         XF86XK_AudioLowerVolume,  CtlDec },
+        { 0,         XF86XK_AudioMute,         CtlToggle },
+};
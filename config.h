@@ -15,10 +15,32 @@ static const char *colors[SchemeLast][3] = {
 static int width = 800;
 static int height = 150;
 
-static int interval = 33;
 static int lifetime = 2500;
 
 static float min_volume_factor = 0.09;
 static float max_volume_factor = 1.0;
 static float max_volume_step = 0.03;
 static float min_volume_step = 0.01;
+
+/* ms to collect sink change events before fetching the sink info */
+static int sink_fetch_delay = 10;
+
+/* ms to wait for the initial sink list from pulseaudio before giving up */
+static int ready_timeout = 2000;
+
+/* sinks shown at once in interactive mode, the list scrolls beyond that */
+static int max_rows = 10;
+
+/* ms the -mock backend takes to answer an operation or injected event */
+static int mock_latency = 1;
+
+/* keep resolved fonts in $XDG_CACHE_HOME/daudio/fonts to skip fontconfig matching on start */
+static int font_cache = 0;
+
+/* grabbed on the root window with -g and handled without spawning anything */
+static const Key media_keys[] = {
+	/* modifier  key                       command */
+	{ 0,         XF86XK_AudioRaiseVolume,  CtlInc },
+	{ 0,         XF86XK_AudioLowerVolume,  CtlDec },
+	{ 0,         XF86XK_AudioMute,         CtlToggle },
+};
@@ -12,18 +12,29 @@ X11LIB = /usr/X11R6/lib
 XINERAMALIBS  = -lXinerama
 XINERAMAFLAGS = -DXINERAMA
 
+# Present, uncomment to hand frames to the server without a round trip each
+#PRESENTLIBS  = -lXpresent -lXfixes
+#PRESENTFLAGS = -DPRESENT
+
+# XCB, pipelines the startup queries and does setup, grabs and presenting
+# on xcb, uncomment if you want it
+#XCBLIBS  = -lX11-xcb -lxcb-xinerama
+#XCBFLAGS = -DXCB
+
 # freetype
-FREETYPELIBS = -lfontconfig -lXft
+FREETYPELIBS = -lfontconfig -lXft -lfreetype
 FREETYPEINC = /usr/include/freetype2
 
 # includes and libs
 INCS = -I$(X11INC) -I$(FREETYPEINC)
-LIBS = -L$(X11LIB) -lX11 $(XINERAMALIBS) $(FREETYPELIBS) -lpthread -lm -lpulse
+LIBS = -L$(X11LIB) -lX11 $(XINERAMALIBS) $(PRESENTLIBS) $(XCBLIBS) $(FREETYPELIBS) -lxcb -ldl -lpthread -lm -lpulse
 
 # flags
-CPPFLAGS = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_XOPEN_SOURCE=700 -D_POSIX_C_SOURCE=200809L -DVERSION=\"$(VERSION)\" $(XINERAMAFLAGS)
+CPPFLAGS = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_XOPEN_SOURCE=700 -D_POSIX_C_SOURCE=200809L -DVERSION=\"$(VERSION)\" $(XINERAMAFLAGS) $(PRESENTFLAGS) $(XCBFLAGS)
 CFLAGS   = -std=c99 -pedantic -Wall -Os $(INCS) $(CPPFLAGS)
 LDFLAGS  = $(LIBS)
+# daudioctl only needs libc, add -static to also skip the dynamic loader
+CTLLDFLAGS =
 
 # compiler and linker
 CC = cc
@@ -0,0 +1,187 @@
+/* See LICENSE file for copyright and license details. */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "ctl.h"
+#include "util.h"
+
+static const struct {
+	const char *name;
+	int hasarg;
+} commands[CtlLast] = {
+	[CtlInc]         = { "inc",         0 },
+	[CtlDec]         = { "dec",         0 },
+	[CtlToggle]      = { "toggle",      0 },
+	[CtlSet]         = { "set",         1 },
+	[CtlSink]        = { "sink",        1 },
+	[CtlShow]        = { "show",        0 },
+	[CtlInteractive] = { "interactive", 0 },
+	[CtlQuery]       = { "query",       0 },
+	[CtlStats]       = { "stats",       0 },
+};
+
+/* The socket lives in the abstract namespace, so there is no file to go
+ * stale, and binding it doubles as the singleton lock. It is keyed by uid
+ * and display so every X session gets its own instance. */
+static socklen_t
+ctl_addr(struct sockaddr_un *addr)
+{
+	const char *display = getenv("DISPLAY");
+	int n;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	n = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "daudio.%u.%s",
+	             (unsigned int)getuid(), display ? display : "");
+	n = MIN(n, (int)sizeof(addr->sun_path) - 2);
+	return offsetof(struct sockaddr_un, sun_path) + 1 + n;
+}
+
+int
+ctl_parse(char *line, CtlCommand *c)
+{
+	char *arg, *end;
+	int i;
+
+	line += strspn(line, " \t");
+	for (end = line + strlen(line); end > line && strchr(" \t\r\n", end[-1]); end--)
+		;
+	*end = '\0';
+	if ((arg = strpbrk(line, " \t"))) {
+		*arg++ = '\0';
+		arg += strspn(arg, " \t");
+	}
+
+	for (i = 0; i < CtlLast; i++) {
+		if (strcmp(line, commands[i].name))
+			continue;
+		if (commands[i].hasarg != (arg && *arg))
+			return -1;
+		c->op = i;
+		c->arg = commands[i].hasarg ? arg : NULL;
+		return 0;
+	}
+	return -1;
+}
+
+/* Returns the listening socket, or -1 if another instance already owns it. */
+int
+ctl_listen(void)
+{
+	struct sockaddr_un addr;
+	socklen_t len = ctl_addr(&addr);
+	int fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+		die("socket:");
+	if (bind(fd, (struct sockaddr *)&addr, len) < 0) {
+		if (errno != EADDRINUSE)
+			die("bind:");
+		close(fd);
+		return -1;
+	}
+	if (listen(fd, 16) < 0)
+		die("listen:");
+	return fd;
+}
+
+/* Returns the next pending client connection, or -1 if there is none. Abstract
+ * sockets have no file permissions, so clients of other users are dropped. */
+int
+ctl_accept(int listenfd)
+{
+	struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+	struct ucred cred;
+	socklen_t len;
+	int fd;
+
+	for (;;) {
+		if ((fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return -1;
+		}
+		len = sizeof(cred);
+		if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != getuid()) {
+			close(fd);
+			continue;
+		}
+		/* a client that never finishes its request must not stall the ui */
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		return fd;
+	}
+}
+
+/* Reads until the peer shuts down its write side or buf is full. */
+ssize_t
+ctl_recv(int fd, char *buf, size_t size)
+{
+	size_t len = 0;
+	ssize_t n;
+
+	while (len < size - 1) {
+		if ((n = read(fd, buf + len, size - 1 - len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break;
+		len += n;
+	}
+	buf[len] = '\0';
+	return len;
+}
+
+int
+ctl_send(int fd, const char *buf)
+{
+	size_t len = strlen(buf);
+	ssize_t n;
+
+	while (len) {
+		if ((n = write(fd, buf, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Sends request to the running instance and reads its replies into reply.
+ * Returns -1 if no instance is listening, otherwise the length of the reply,
+ * which is 0 if the instance went away before answering. */
+int
+ctl_transact(const char *request, char *reply, size_t size)
+{
+	struct sockaddr_un addr;
+	socklen_t len = ctl_addr(&addr);
+	ssize_t n;
+	int fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		die("socket:");
+	if (connect(fd, (struct sockaddr *)&addr, len) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (ctl_send(fd, request) < 0 || shutdown(fd, SHUT_WR) < 0) {
+		close(fd);
+		return 0;
+	}
+	n = ctl_recv(fd, reply, size);
+	close(fd);
+	return MAX(n, 0);
+}
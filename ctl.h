@@ -0,0 +1,25 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Control protocol of a running instance: a client sends one command per
+ * line, shuts down its write side and reads one reply line per command,
+ * "ok <volume percent> <muted>" or "error <reason>". stats is answered
+ * with "stats" followed by name=value counters instead. */
+
+enum { CtlInc, CtlDec, CtlToggle, CtlSet, CtlSink, CtlShow, CtlInteractive, CtlQuery, CtlStats, CtlLast }; /* commands */
+
+typedef struct {
+	int op;
+	const char *arg; /* points into the parsed line, NULL if the command has none */
+} CtlCommand;
+
+int ctl_parse(char *line, CtlCommand *c);
+
+/* server side */
+int ctl_listen(void);
+int ctl_accept(int listenfd);
+
+/* client side */
+int ctl_transact(const char *request, char *reply, size_t size);
+
+ssize_t ctl_recv(int fd, char *buf, size_t size);
+int ctl_send(int fd, const char *buf);
@@ -1,4 +1,5 @@
 /* See LICENSE file for copyright and license details. */
+#include <ctype.h>
 #include <locale.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,13 +10,17 @@
 #include <math.h>
 
 
-#include <sys/file.h>
 #include <errno.h>
 
+#include <poll.h>
 #include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/XF86keysym.h>
 
 #ifdef XINERAMA
 
@@ -23,23 +28,49 @@
 
 #endif
 #include <X11/Xft/Xft.h>
+#ifdef XCB
+#include <X11/Xlib-xcb.h>
+#ifdef XINERAMA
+#include <xcb/xinerama.h>
+#endif
+#endif
 
+#include "ctl.h"
 #include "drw.h"
+#include "fontcache.h"
+#include "mock.h"
 #include "util.h"
 #include "pulseaudio.h"
+#include "roundtrip.h"
 
 /* macros */
 #define INTERSECT(x, y, w, h, r)  (MAX(0, MIN((x)+(w),(r).x_org+(r).width)  - MAX((x),(r).x_org)) \
                              && MAX(0, MIN((y)+(h),(r).y_org+(r).height) - MAX((y),(r).y_org)))
 #define LENGTH(X)             (sizeof (X) / sizeof (X)[0])
+#define CLEANMASK(mask)       (mask & ~(numlockmask|LockMask) & (ShiftMask|ControlMask|Mod1Mask|Mod2Mask|Mod3Mask|Mod4Mask|Mod5Mask))
 
 enum {
     SchemeSel, SchemeNorm, SchemeMuted, SchemeLast
 };
+enum {
+    FdX, FdPulse, FdTimer, FdSignal, FdCtl, FdLast
+}; /* run() poll slots */
+
+typedef struct {
+    unsigned int mod;
+    KeySym keysym;
+    int op; /* control command, see ctl.h */
+} Key;
+
 static char *embed;
 static int bh, mw, mh, lrpad;
 static int mon = -1, screen;
 static char interactive;
+static char resident, mapped;
+static char grabkeys;
+static unsigned int numlockmask;
+static int grab_failed;
+static int headless, report_rtt;
 
 static Display *dpy;
 static Window root, parentWin, win;
@@ -49,14 +80,73 @@ static Drw *drw;
 static Clr *scheme[SchemeLast];
 
 static struct timespec last_draw;
+static int timer_fd = -1, signal_fd = -1, ctl_fd = -1;
 
 
 static uint32_t selected_sink;
+/* snapshot published by the pulse thread, refreshed with get_state() */
+static const PulseState *state;
+static unsigned long drawn_generation;
+
+/* what was last painted into the drawable, see draw() */
+typedef struct {
+    SinkHandle handle;
+    char description[sizeof(((PulseSink *) 0)->description)];
+    char marked, selected;
+} Row;
+
+static char painted, painted_mute;
+static int painted_bar;
+static Row *painted_rows;
+static int painted_rows_cap;
+
+/* pre-rendered rows, see row_pixmap() */
+typedef struct {
+    SinkHandle handle;
+    char description[sizeof(((PulseSink *) 0)->description)];
+    char marked;
+    int w;
+    Pixmap pix[2];  /* normal and selected */
+} RowPixmap;
+
+/* first sink shown in the list, at most max_rows are shown */
+static int scroll;
+
+/* Type-to-filter, started with '/'. Every typed chunk pushes a level with the
+ * sinks still matching, so typing only rescans the previous matches and
+ * backspace pops a level. Level 0 is the unfiltered list. */
+typedef struct {
+    size_t len;  /* query length at this level */
+    int *items;  /* positions in state->sinks */
+    int n, cap;
+} Matches;
+
+static char searching;
+static char query[sizeof(((PulseSink *) 0)->description)];
+static char painted_query[sizeof(query) + 1];
+static Matches *levels;
+static int nlevels, levels_cap;
+static unsigned long filtered_generation;
+
+static RowPixmap *row_pixmaps;
+static int nrow_pixmaps, row_pixmaps_cap;
+
+static XRectangle *damaged;
+static int ndamaged, damaged_cap, full_damage;
+static unsigned long frames, frame_pixels, total_pixels;
+/* round trips to X until the window was set up, see roundtrip.h */
+static unsigned long startup_roundtrips;
 
 static char *cmd;
 
 static char buf[32];
 
+/* input of the current frame, applied once all pending X events are read */
+static int volume_steps;
+static char redraw, reveal;
+/* a frame skipped because the last one is still being presented */
+static char frame_deferred;
+
 
 #include "config.h"
 
@@ -65,6 +155,12 @@ static void
 cleanup(void) {
 	if (dpy) {
 		XUngrabKey(dpy, AnyKey, AnyModifier, root);
+    	for (int i = 0; i < nrow_pixmaps; i++) {
+    		drw_pixmap_free(drw, row_pixmaps[i].pix[0]);
+    		drw_pixmap_free(drw, row_pixmaps[i].pix[1]);
+    	}
+    	fontcache_save();
+    	fontcache_free();
     	drw_free(drw);
     	XSync(dpy, False);
     	XCloseDisplay(dpy);
@@ -72,194 +168,580 @@ cleanup(void) {
     for (size_t i = 0; i < SchemeLast; i++) {
         free(scheme[i]);
     }
+    free(painted_rows);
+    free(row_pixmaps);
+    for (int i = 0; i < levels_cap; i++) {
+        free(levels[i].items);
+    }
+    free(levels);
+    free(damaged);
+    if (timer_fd >= 0)
+        close(timer_fd);
+    if (signal_fd >= 0)
+        close(signal_fd);
+    if (ctl_fd >= 0)
+        close(ctl_fd);
     free_pulse();
 }
 
 static float
-get_volume_ratio(void) {
-    const PulseSink *sink = get_default_sink();
-    float result = ((float) (sink->volume - min_volume_factor * PA_VOLUME_NORM)) / ((float) PA_VOLUME_NORM * (max_volume_factor - min_volume_factor));
+volume_to_ratio(pa_volume_t volume) {
+    float result = ((float) (volume - min_volume_factor * PA_VOLUME_NORM)) / ((float) PA_VOLUME_NORM * (max_volume_factor - min_volume_factor));
     result = MAX(result, 0);
     result = MIN(result, 1);
     return result;
 }
 
+
 static void toggle_mute() {
     pulse_lock();
     const PulseSink* sink = get_default_sink();
-    set_mute(sink, !sink->mute);
+    if (sink) {
+        set_mute(sink, !sink->mute);
+    }
     pulse_unlock();
 }
 
-static void change_volume(float direction) {
+/* Moves the volume by steps steps of the ratio dependent step size. All steps
+ * are applied to the local volume and sent as one target. Returns -1 if there
+ * is no default sink, which happens for a moment while sinks come and go. */
+static int change_volume(int steps) {
     pulse_lock();
     const PulseSink* sink = get_default_sink();
     if (!sink) {
-        die("change_volume failed: no default sink");
-        return;
+        pulse_unlock();
+        return -1;
     }
-    uint32_t volume = sink->volume;
+    int volume = (int) sink->volume;
+    uint8_t mute = sink->mute;
     int max_volume = (int) roundf(max_volume_factor * PA_VOLUME_NORM);
     int min_volume = (int) roundf(min_volume_factor * PA_VOLUME_NORM);
+    float direction = steps < 0 ? -1 : 1;
+
+    for (int i = 0; i < abs(steps); i++) {
+        float volume_step = (min_volume_step + (max_volume_step - min_volume_step) * volume_to_ratio(volume)) *
+                             ((float) (max_volume - min_volume));
+        volume_step = MAX(1.0, volume_step);
+        volume_step *= direction;
+
+        // Ensure that previous volume is within limits.
+        // Without this, edge case can occur where the first/last step needs to be fired twice
+        if (volume <= min_volume_factor * PA_VOLUME_NORM * 1.001) {
+            volume = MAX(min_volume, volume);
+            mute = 0;
+        } else {
+            volume = MIN(max_volume, volume);
+        }
 
 
-    float volume_step = (min_volume_step + (max_volume_step - min_volume_step) * get_volume_ratio()) *
-                         ((float) (max_volume - min_volume));
-    volume_step = MAX(1.0, volume_step);
-    volume_step *= direction;
+        volume += (int) roundf(volume_step);
 
-    // Ensure that previous volume is within limits.
-    // Without this, edge case can occur where the first/last step needs to be fired twice
-    if (volume <= min_volume_factor * PA_VOLUME_NORM * 1.001) {
-        volume = MAX(min_volume, volume);
-        set_mute(sink, 0);
-    } else {
-        volume = MIN(max_volume, volume);
+        // Ensure that new volume is within limits.
+        if (volume <= min_volume) {
+            volume = min_volume;
+            mute = 1;
+        } else if (volume >= max_volume * 0.995) {
+            volume = max_volume;
+        }
+    }
+    if (mute != sink->mute) {
+        set_mute(sink, mute);
     }
+    set_volume(sink, volume);
+    pulse_unlock();
+    return 0;
+}
 
+static void wait_for_default_sink() {
+    if (wait_for_pulse(ready_timeout) < 0) {
+        die("no answer from pulseaudio within %d ms", ready_timeout);
+    }
+    if ((state = get_state())->default_sink < 0) {
+        die("no default sink");
+    }
+}
+
+static int set_volume_percent(const char *arg) {
+    char *end;
+    long percent = strtol(arg, &end, 10);
+
+    if (end == arg || *end || percent < 0) {
+        return -1;
+    }
 
-    volume += (int) roundf(volume_step);
+    pulse_lock();
+    const PulseSink *sink = get_default_sink();
+    if (!sink) {
+        pulse_unlock();
+        return -1;
+    }
+    int max_volume = (int) roundf(max_volume_factor * PA_VOLUME_NORM);
+    int min_volume = (int) roundf(min_volume_factor * PA_VOLUME_NORM);
+    int volume = (int) roundf((float) percent / 100.0f * PA_VOLUME_NORM);
 
-    // Ensure that new volume is within limits.
-    if (volume <= min_volume) {
-        volume = min_volume;
-        set_mute(sink, 1);
-    } else if (volume >= max_volume * 0.995) {
-        volume = max_volume;
+    volume = MIN(MAX(volume, min_volume), max_volume);
+    if (sink->mute != (volume <= min_volume)) {
+        set_mute(sink, volume <= min_volume);
     }
     set_volume(sink, volume);
     pulse_unlock();
+    return 0;
 }
 
-static void wait_for_default_sink() {
-    struct timespec ts = {.tv_sec = 0, .tv_nsec = 100000};
-    for (int i = 0; i < 100; ++i) {
-        if (get_default_sink()) {
-            return;
+/* Makes the sink with the given name or description the default sink. */
+static int select_sink(const char *arg) {
+    state = get_state();
+    for (int i = 0; i < state->sinks_count; i++) {
+        const PulseSink *sink = &state->sinks[i];
+        if (strcmp(sink->name, arg) == 0 || strcmp(sink->description, arg) == 0) {
+            pulse_lock();
+            set_default_sink(sink);
+            pulse_unlock();
+            return 0;
         }
-        nanosleep(&ts, NULL);
     }
-    die("execute_cli_command failed: no default sink");
+    return -1;
+}
 
+static char *cistrstr(const char *h, const char *n) {
+    size_t i;
+
+    if (!n[0])
+        return (char *) h;
+
+    for (; *h; ++h) {
+        for (i = 0; n[i] && tolower((unsigned char) n[i]) == tolower((unsigned char) h[i]); ++i);
+        if (n[i] == '\0')
+            return (char *) h;
+    }
+    return NULL;
 }
 
-static void execute_cli_command(void) {
-    if (cmd == NULL) {
-        return;
+static Matches *push_level(size_t len, int size) {
+    Matches *m;
+
+    if (nlevels == levels_cap) {
+        levels_cap = levels_cap ? levels_cap * 2 : 8;
+        if (!(levels = realloc(levels, levels_cap * sizeof(*levels))))
+            die("realloc:");
+        memset(levels + nlevels, 0, (levels_cap - nlevels) * sizeof(*levels));
     }
+    m = &levels[nlevels++];
+    if (size > m->cap) {
+        m->cap = size;
+        if (!(m->items = realloc(m->items, m->cap * sizeof(*m->items))))
+            die("realloc:");
+    }
+    m->len = len;
+    m->n = 0;
+    return m;
+}
 
-    wait_for_default_sink();
+/* Pushes the matches of the first len bytes of the query, taken from the
+ * top level since a longer query only ever matches fewer sinks. */
+static void narrow(size_t len) {
+    char saved = query[len];
+    int prev = nlevels - 1;
+    Matches *m = push_level(len, levels[prev].n);
+
+    query[len] = '\0';
+    for (int i = 0; i < levels[prev].n; i++) {
+        const PulseSink *sink = &state->sinks[levels[prev].items[i]];
+        if (cistrstr(sink->description, query) || cistrstr(sink->name, query))
+            m->items[m->n++] = levels[prev].items[i];
+    }
+    query[len] = saved;
+}
 
-    if (strcmp(cmd, "toggle") == 0) {
-        toggle_mute();
-    } else if (strcmp(cmd, "inc") == 0){
-        change_volume(1);
-    } else if (strcmp(cmd, "dec") == 0) {
-        change_volume(-1);
+/* Returns the sinks shown in the list, rebuilding every level after the
+ * snapshot changed. */
+static Matches *shown(void) {
+    if (nlevels == 0 || filtered_generation != state->generation) {
+        int depth = nlevels;
+        size_t lens[depth ? depth : 1];
+        Matches *m;
+
+        for (int i = 0; i < depth; i++)
+            lens[i] = levels[i].len;
+        nlevels = 0;
+        m = push_level(0, state->sinks_count);
+        for (m->n = 0; m->n < state->sinks_count; m->n++)
+            m->items[m->n] = m->n;
+        for (int i = 1; i < depth; i++)
+            narrow(lens[i]);
+        filtered_generation = state->generation;
     }
+    return &levels[nlevels - 1];
+}
+
+static void stop_search(void) {
+    searching = 0;
+    query[0] = '\0';
+    nlevels = MIN(nlevels, 1);
+}
+
+/* Returns the position of the selected sink in m, moving the selection to the
+ * first match if it was filtered out, or -1 if nothing matches. */
+static int selected_row(Matches *m) {
+    for (int i = 0; i < m->n; i++)
+        if (m->items[i] == selected_sink)
+            return i;
+    if (m->n == 0)
+        return -1;
+    selected_sink = m->items[0];
+    return 0;
+}
+
+static void move_selection(int delta) {
+    Matches *m = shown();
+    int row = selected_row(m) + delta;
+
+    if (row >= 0 && row < m->n)
+        selected_sink = m->items[row];
+}
+
+/* Handles a key while searching, returns 0 for keys that keep their meaning. */
+static int search_key(KeySym ksym, Status status, int len) {
+    size_t qlen = strlen(query);
+
+    switch (ksym) {
+        case XK_Escape:
+            stop_search();
+            return 1;
+        case XK_BackSpace:
+            shown();
+            if (nlevels > 1) {
+                nlevels--;
+                query[levels[nlevels - 1].len] = '\0';
+            } else {
+                stop_search();
+            }
+            return 1;
+        case XK_Up:
+        case XK_Down:
+        case XK_Left:
+        case XK_Right:
+        case XK_Return:
+        case XK_KP_Enter:
+            return 0;
+    }
+    if (status == XLookupKeySym || len <= 0 || iscntrl((unsigned char) buf[0]))
+        return 0;
+    if (qlen + len < sizeof(query)) {
+        shown();
+        memcpy(query + qlen, buf, len);
+        query[qlen + len] = '\0';
+        narrow(qlen + len);
+    }
+    return 1;
 }
 
 static void set_selected_to_default_sink() {
-    pulse_lock();
-    if (selected_sink > get_sinks_count()) {
-        pulse_unlock();
+    if (selected_row(shown()) < 0) {
         return;
     };
-    set_default_sink(&get_sinks()[selected_sink]);
+    pulse_lock();
+    set_default_sink(&state->sinks[selected_sink]);
     pulse_unlock();
 }
 
+static void arm_lifetime(void) {
+    struct itimerspec its = {0};
+
+    /* the timer fires lifetime ms after the last draw, every draw pushes it back */
+    its.it_value = last_draw;
+    timespecAddMs(&its.it_value, lifetime);
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        die("timerfd_settime:");
+    }
+}
+
+static void add_damage(int x, int y, int w, int h) {
+    XRectangle *last = ndamaged ? &damaged[ndamaged - 1] : NULL;
+
+    if (full_damage) {
+        return;
+    }
+    /* neighbouring regions (marker and text, consecutive rows) become one copy */
+    if (last && last->y == y && last->height == h && last->x + last->width == x) {
+        last->width += w;
+        return;
+    }
+    if (last && last->x == x && last->width == w && last->y + last->height == y) {
+        last->height += h;
+        return;
+    }
+    if (ndamaged == damaged_cap) {
+        damaged_cap = damaged_cap ? damaged_cap * 2 : 8;
+        if (!(damaged = realloc(damaged, damaged_cap * sizeof(*damaged))))
+            die("realloc:");
+    }
+    damaged[ndamaged++] = (XRectangle) {x, y, w, h};
+}
+
+/* The line between the bar and the list shows the query while searching. */
+static void draw_query(int y) {
+    char line[sizeof(painted_query)] = "";
+
+    if (searching)
+        snprintf(line, sizeof(line), "/%s", query);
+    if (painted && strcmp(line, painted_query) == 0)
+        return;
+    drw_setscheme(drw, scheme[SchemeNorm]);
+    drw_text(drw, 0, y, mw, bh, lrpad / 2, line, 0);
+    add_damage(0, y, mw, bh);
+    strlcpy(painted_query, line, sizeof(painted_query));
+}
+
+static void draw_bar(const PulseSink *sink, int height) {
+    int w = sink ? (int) ((float) mw * volume_to_ratio(sink->volume)) : 0;
+    char muted = sink && sink->mute;
+
+    if (painted && w == painted_bar && muted == painted_mute) {
+        return;
+    }
+    drw_setscheme(drw, scheme[SchemeNorm]);
+    drw_rect(drw, 0, 0, mw, height, 1, 1);
+    drw_setscheme(drw, scheme[muted ? SchemeMuted : SchemeSel]);
+    drw_rect(drw, 0, 0, w, height, 1, 1);
+    add_damage(0, 0, mw, height);
+    painted_bar = w;
+    painted_mute = muted;
+}
+
+/* Returns the row of sink pre-rendered in the given look. Both looks are kept
+ * until the description, the marker or the width change. */
+static Pixmap row_pixmap(const PulseSink *sink, char marked, char selected) {
+    RowPixmap *r = NULL;
+    Drawable target;
+
+    for (int i = 0; i < nrow_pixmaps; i++) {
+        if (row_pixmaps[i].handle == sink->handle) {
+            r = &row_pixmaps[i];
+            break;
+        }
+    }
+    if (!r) {
+        if (nrow_pixmaps == row_pixmaps_cap) {
+            row_pixmaps_cap = row_pixmaps_cap ? row_pixmaps_cap * 2 : 8;
+            if (!(row_pixmaps = realloc(row_pixmaps, row_pixmaps_cap * sizeof(*row_pixmaps))))
+                die("realloc:");
+        }
+        r = &row_pixmaps[nrow_pixmaps++];
+        memset(r, 0, sizeof(*r));
+        r->handle = sink->handle;
+    }
+    if (r->w != mw || r->marked != marked || strcmp(r->description, sink->description) != 0) {
+        /* a renamed sink leaves a stale layout behind */
+        if (r->w && strcmp(r->description, sink->description) != 0)
+            drw_text_invalidate(drw, r->description);
+        drw_pixmap_free(drw, r->pix[0]);
+        drw_pixmap_free(drw, r->pix[1]);
+        r->pix[0] = r->pix[1] = None;
+        r->w = mw;
+        r->marked = marked;
+        strlcpy(r->description, sink->description, sizeof(r->description));
+    }
+    if (!r->pix[(int) selected]) {
+        r->pix[(int) selected] = drw_pixmap_create(drw, mw, bh);
+        target = drw_settarget(drw, r->pix[(int) selected]);
+        drw_setscheme(drw, scheme[selected ? SchemeSel : SchemeNorm]);
+        drw_text(drw, 0, 0, bh, bh, lrpad / 2, marked ? "*" : "", 0);
+        drw_text(drw, bh, 0, mw - bh, bh, lrpad / 2, sink->description, 0);
+        drw_settarget(drw, target);
+    }
+    return r->pix[(int) selected];
+}
+
+/* Frees the rows of sinks that are gone. */
+static void sweep_row_pixmaps(void) {
+    for (int i = 0; i < nrow_pixmaps; ) {
+        int found = 0;
+        for (int j = 0; j < state->sinks_count && !found; j++) {
+            found = state->sinks[j].handle == row_pixmaps[i].handle;
+        }
+        if (found) {
+            i++;
+            continue;
+        }
+        drw_pixmap_free(drw, row_pixmaps[i].pix[0]);
+        drw_pixmap_free(drw, row_pixmaps[i].pix[1]);
+        row_pixmaps[i] = row_pixmaps[--nrow_pixmaps];
+    }
+}
+
+/* A row is the default sink marker followed by the description, copied from
+ * its pre-rendered pixmap if it differs from what was painted there. */
+static void draw_row(Row *row, int y, const PulseSink *sink, char marked, char selected) {
+    /* rows below the last match stay empty, the window keeps its size */
+    if (!sink) {
+        if (painted && !row->handle)
+            return;
+        drw_setscheme(drw, scheme[SchemeNorm]);
+        drw_rect(drw, 0, y, mw, bh, 1, 1);
+        add_damage(0, y, mw, bh);
+        row->handle = 0;
+        return;
+    }
+    if (painted && row->handle == sink->handle && row->selected == selected && row->marked == marked
+        && strcmp(row->description, sink->description) == 0) {
+        return;
+    }
+    drw_copy(drw, row_pixmap(sink, marked, selected), 0, 0, mw, bh, 0, y);
+    add_damage(0, y, mw, bh);
+    row->handle = sink->handle;
+    row->selected = selected;
+    row->marked = marked;
+    strlcpy(row->description, sink->description, sizeof(row->description));
+}
+
+/* Renders the newest snapshot, never waits for the pulse thread. Only the
+ * regions that differ from what was painted last are repainted and copied. */
 static void draw(void) {
-    pulse_lock();
+    if (drw_busy(drw)) {
+        frame_deferred = 1;
+        return;
+    }
+    frame_deferred = 0;
+    state = get_state();
+    drawn_generation = state->generation;
 
-    int sinks_count = get_sinks_count();
-    const PulseSink *default_sink = get_default_sink();
+    int sinks_count = state->sinks_count;
+    const PulseSink *default_sink = state->default_sink >= 0 ? &state->sinks[state->default_sink] : NULL;
 
     int bar_height = (int) 1.5f * bh;
-    int newMh = (int) (bar_height + (interactive ? bh + bh * sinks_count : 0));
+    int visible = MIN(sinks_count, max_rows);
+    int newMh = (int) (bar_height + (interactive ? bh + bh * visible : 0));
 
     if (mh != newMh) {
         mh = newMh;
-        XResizeWindow(dpy, win, mw, mh);
+        /* there is no window to resize when drawing without a display */
+        if (dpy)
+            XResizeWindow(dpy, win, mw, mh);
         drw_resize(drw, mw, mh);
+        painted = 0;
     }
 
-    drw_setscheme(drw, scheme[SchemeNorm]);
-    drw_rect(drw, 0, 0, mw, mh, 1, 1);
-
-    float volume_ratio = get_volume_ratio();
-    int w = (int) ((float) mw * volume_ratio);
-    if (default_sink->mute) {
-        drw_setscheme(drw, scheme[SchemeMuted]);
-    } else {
-        drw_setscheme(drw, scheme[SchemeSel]);
+    ndamaged = 0;
+    full_damage = 0;
+    if (!painted) {
+        drw_setscheme(drw, scheme[SchemeNorm]);
+        drw_rect(drw, 0, 0, mw, mh, 1, 1);
+        add_damage(0, 0, mw, mh);
+        full_damage = 1;
     }
 
-    drw_rect(drw, 0, 0, w, bar_height, 1, 1);
+    draw_bar(default_sink, bar_height);
 
     if (interactive) {
-        drw_setscheme(drw, scheme[SchemeNorm]);
-
-        int y = bar_height + bh;
+        if (visible > painted_rows_cap) {
+            painted_rows_cap = visible;
+            if (!(painted_rows = realloc(painted_rows, painted_rows_cap * sizeof(*painted_rows))))
+                die("realloc:");
+        }
+        Matches *list = shown();
+        int selected = selected_row(list);
 
-        const PulseSink *pulse_sinks = get_sinks();
+        /* scroll just far enough to keep the selection in view */
+        if (selected < scroll)
+            scroll = selected;
+        else if (selected >= scroll + visible)
+            scroll = selected - visible + 1;
+        scroll = MAX(0, MIN(scroll, list->n - visible));
 
-        for (size_t index = 0; index < sinks_count; index++) {
-            const PulseSink *sink = &pulse_sinks[index];
+        draw_query(bar_height);
+        int y = bar_height + bh;
 
-            if (index == selected_sink) {
-                drw_setscheme(drw, scheme[SchemeSel]);
-                drw_rect(drw, 0, y, mw, bh, 1, 1);
+        for (int row = 0; row < visible; row++) {
+            if (scroll + row < list->n) {
+                int index = list->items[scroll + row];
+                draw_row(&painted_rows[row], y, &state->sinks[index], index == state->default_sink,
+                         index == selected_sink);
             } else {
-                drw_setscheme(drw, scheme[SchemeNorm]);
-            }
-            if (sink == default_sink) {
-                drw_text(drw, 0, y, mw, bh, lrpad / 2, "*", 0);
+                draw_row(&painted_rows[row], y, NULL, 0, 0);
             }
-            drw_text(drw, bh, y, mw - bh, bh, lrpad / 2, sink->description, 0);
             y += bh;
         }
+        if (nrow_pixmaps > sinks_count)
+            sweep_row_pixmaps();
     }
-    drw_map(drw, win, 0, 0, mw, mh);
+    painted = 1;
+
+    if (ndamaged) {
+        drw_map_rects(drw, win, damaged, ndamaged);
+    }
+    frames++;
+    frame_pixels = 0;
+    for (int i = 0; i < ndamaged; i++) {
+        frame_pixels += (unsigned long) damaged[i].width * damaged[i].height;
+    }
+    total_pixels += frame_pixels;
 
     if (clock_gettime(CLOCK_MONOTONIC, &last_draw) < 0) {
         die("clock_gettime:");
     }
-    pulse_unlock();
+    arm_lifetime();
+}
+
+/* Unmaps the window of a resident instance, keeping X, fonts and pulse alive. */
+static void hide(void) {
+    stop_search();
+    /* a resident instance may never exit, keep what it resolved so far */
+    fontcache_save();
+    if (interactive) {
+        XUngrabKeyboard(dpy, CurrentTime);
+        interactive = 0;
+    }
+    XUnmapWindow(dpy, win);
+    XFlush(dpy);
+    mapped = 0;
+}
+
+static void quit(void) {
+    if (!resident)
+        exit(0);
+    hide();
 }
 
 static void keypress(XKeyEvent *ev) {
-    KeySym ksym;
+    KeySym ksym = NoSymbol;
     Status status;
+    int len;
 
-    XmbLookupString(xic, ev, buf, sizeof buf, &ksym, &status);
+    len = XmbLookupString(xic, ev, buf, sizeof buf, &ksym, &status);
     switch (status) {
         default: /* XLookupNone, XBufferOverflow */
             return;
+        case XLookupChars:
         case XLookupKeySym:
         case XLookupBoth:
             break;
     }
+    if (searching && search_key(ksym, status, len)) {
+        redraw = 1;
+        return;
+    }
     switch (ksym) {
         default:
             return;
         case XK_Right:
         case 0x1008ff13:
-            change_volume(1);
+            volume_steps++;
             break;
         case XK_Left:
         case 0x1008ff11:
-            change_volume(-1);
+            volume_steps--;
             break;
         case XK_Up:
-            if (selected_sink > 0) {
-                selected_sink--;
-            }
+            move_selection(-1);
             break;
         case XK_Down:
-            if (selected_sink < get_sinks_count() - 1) {
-                selected_sink++;
-            }
+            move_selection(1);
+            break;
+        case XK_slash:
+            if (!interactive)
+                return;
+            searching = 1;
             break;
         case XK_Return:
         case XK_KP_Enter:
@@ -271,11 +753,54 @@ static void keypress(XKeyEvent *ev) {
             break;
         case XK_Escape:
         case XK_q:
-            exit(0);
+            quit();
+            return;
     }
-    draw();
+    redraw = 1;
 }
 
+#ifdef XCB
+/* The focus is set and read back together, one round trip per attempt. */
+static void grab_focus(void) {
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = 10000000};
+    xcb_connection_t *c = XGetXCBConnection(dpy);
+    xcb_get_input_focus_reply_t *focus;
+    xcb_window_t focuswin;
+    int i;
+
+    for (i = 0; i < 100; ++i) {
+        xcb_set_input_focus(c, XCB_INPUT_FOCUS_PARENT, win, XCB_CURRENT_TIME);
+        focus = xcb_get_input_focus_reply(c, xcb_get_input_focus(c), NULL);
+        focuswin = focus ? focus->focus : XCB_NONE;
+        free(focus);
+        if (focuswin == win)
+            return;
+        nanosleep(&ts, NULL);
+    }
+    die("cannot grab focus");
+}
+
+static void grab_keyboard(void) {
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = 1000000};
+    xcb_connection_t *c = XGetXCBConnection(dpy);
+    xcb_grab_keyboard_reply_t *grab;
+    int i, status;
+
+    if (embed)
+        return;
+    /* try to grab keyboard, we may have to wait for another process to ungrab */
+    for (i = 0; i < 1000; i++) {
+        grab = xcb_grab_keyboard_reply(c, xcb_grab_keyboard(c, 1, root, XCB_CURRENT_TIME, XCB_GRAB_MODE_ASYNC,
+                                                            XCB_GRAB_MODE_ASYNC), NULL);
+        status = grab ? grab->status : XCB_GRAB_STATUS_NOT_VIEWABLE;
+        free(grab);
+        if (status == XCB_GRAB_STATUS_SUCCESS)
+            return;
+        nanosleep(&ts, NULL);
+    }
+    die("cannot grab keyboard");
+}
+#else
 static void grab_focus(void) {
     struct timespec ts = {.tv_sec = 0, .tv_nsec = 10000000};
     Window focuswin;
@@ -306,50 +831,13 @@ static void grab_keyboard(void) {
     }
     die("cannot grab keyboard");
 }
-
-static void handle_events(void) {
-    XEvent ev;
-
-    while (XPending(dpy) && !XNextEvent(dpy, &ev)) {
-        if (XFilterEvent(&ev, win))
-            continue;
-        switch (ev.type) {
-            case FocusIn:
-                /* regrab focus from parent window */
-                if (ev.xfocus.window != win)
-                    grab_focus();
-                break;
-            case KeyPress:
-                keypress(&ev.xkey);
-                break;
-            case DestroyNotify:
-                if (ev.xdestroywindow.window != win)
-                    break;
-                exit(1);
-            case Expose:
-                if (ev.xexpose.count == 0)
-                    drw_map(drw, win, 0, 0, mw, mh);
-                break;
-            case VisibilityNotify:
-                if (ev.xvisibility.state != VisibilityUnobscured)
-                    XRaiseWindow(dpy, win);
-                break;
-        }
-    }
-}
+#endif
 
 static void update_selected_sink() {
-    pulse_lock();
-    const PulseSink *sinks = get_sinks();
-    const PulseSink *default_sink = get_default_sink();
-
-    for (size_t i = 0; i < get_sinks_count(); i++) {
-        if (&sinks[i] == default_sink) {
-            selected_sink = i;
-            break;
-        }
+    state = get_state();
+    if (state->default_sink >= 0) {
+        selected_sink = state->default_sink;
     }
-    pulse_unlock();
 }
 
 static void setup_interactive() {
@@ -358,121 +846,191 @@ static void setup_interactive() {
     }
 }
 
-static void handle_pulse_updates() {
-    if (get_dirty()) {
-        update_selected_sink();
-        draw();
-        set_dirty(0);
+static int execute_command(const CtlCommand *c) {
+    switch (c->op) {
+        case CtlInc:
+            return change_volume(1);
+        case CtlDec:
+            return change_volume(-1);
+        case CtlToggle:
+            toggle_mute();
+            break;
+        case CtlSet:
+            return set_volume_percent(c->arg);
+        case CtlSink:
+            return select_sink(c->arg);
+        case CtlInteractive:
+            interactive = 1;
+            /* at startup setup() grabs the keyboard once the window exists */
+            if (dpy)
+                setup_interactive();
+            break;
+        case CtlShow:
+        case CtlQuery:
+        case CtlStats:
+            break;
     }
+    return 0;
 }
 
-static void handle_sigusr1() {
-    pulse_lock();
-    interactive = 1;
-    setup_interactive();
-    pulse_unlock();
-    set_dirty(1);
-}
+static void execute_cli_command(void) {
+    char line[256];
+    CtlCommand c;
 
-static void run(void) {
-    struct timespec start, current, diff, interval_spec, wait;
-    timespec_set_ms(&interval_spec, interval);
+    if (cmd == NULL) {
+        return;
+    }
 
-    for (;;) {
+    wait_for_default_sink();
 
-        if (clock_gettime(CLOCK_MONOTONIC, &start) < 0) {
-            die("clock_gettime:");
-        }
+    strlcpy(line, cmd, sizeof(line));
+    if (ctl_parse(line, &c) < 0 || execute_command(&c) < 0) {
+        die("invalid command: %s", cmd);
+    }
+}
 
-        timespec_diff(&diff, &start, &last_draw);
-        if (timespec_to_ms(&diff) > lifetime) {
-            exit(0);
-        }
+/* Formats the "ok" reply of the control protocol. */
+static int format_status(char *dst, size_t size) {
+    state = get_state();
+    const PulseSink *sink = state->default_sink >= 0 ? &state->sinks[state->default_sink] : NULL;
+    return snprintf(dst, size, "ok %d %d\n",
+                    sink ? (int) roundf(sink->volume * 100.0f / PA_VOLUME_NORM) : 0,
+                    sink ? sink->mute : 0);
+}
 
-        handle_events();
-        handle_pulse_updates();
+static int format_stats(char *dst, size_t size) {
+    pulse_lock();
+    const PulseStats *stats = get_pulse_stats();
+    GlyphStats glyphs = drw ? drw->glyphstats : (GlyphStats) {0};
+    int n = snprintf(dst, size, "stats events=%lu fetches=%lu frames=%lu pixels=%lu last=%lu "
+                     "glyph_hits=%lu glyph_misses=%lu fc_calls=%lu "
+                     "startup_roundtrips=%lu roundtrips=%lu\n",
+                     stats->events, stats->fetches, frames, total_pixels, frame_pixels,
+                     glyphs.hits, glyphs.misses, glyphs.fc_calls,
+                     startup_roundtrips, roundtrip_count());
+    pulse_unlock();
+    return n;
+}
 
+/* Size of a window, XGetWindowAttributes costs two round trips where one
+ * GetGeometry is enough. Returns 0 if the window does not exist. */
+static int window_size(Window w, int *width, int *height) {
+#ifdef XCB
+    xcb_connection_t *c = XGetXCBConnection(dpy);
+    xcb_get_geometry_reply_t *geo = xcb_get_geometry_reply(c, xcb_get_geometry(c, w), NULL);
+
+    *width = *height = 0;
+    if (!geo)
+        return 0;
+    *width = geo->width;
+    *height = geo->height;
+    free(geo);
+#else
+    XWindowAttributes wa;
 
-        if (clock_gettime(CLOCK_MONOTONIC, &current) < 0) {
-            die("clock_gettime:");
-        }
+    *width = *height = 0;
+    if (!XGetWindowAttributes(dpy, w, &wa))
+        return 0;
+    *width = wa.width;
+    *height = wa.height;
+#endif
+    return 1;
+}
 
-        timespec_diff(&diff, &current, &start);
-        timespec_diff(&wait, &interval_spec, &diff);
+/* Centers the window on the monitor with the input focus (or the pointer). */
+#ifdef XCB
+/* Same as the Xlib version, but independent queries are sent together and
+ * their replies collected afterwards. */
+static void place(int *px, int *py) {
+    int x = 0, y = 0, ww, wh;
+#ifdef XINERAMA
+    xcb_connection_t *c = XGetXCBConnection(dpy);
+    xcb_xinerama_query_screens_cookie_t screens_ck;
+    xcb_get_input_focus_cookie_t focus_ck;
+    xcb_query_pointer_cookie_t pointer_ck;
+    xcb_xinerama_query_screens_reply_t *screens = NULL;
+    xcb_get_input_focus_reply_t *focus = NULL;
+    xcb_query_pointer_reply_t *pointer = NULL;
+    xcb_query_tree_reply_t *tree;
+    xcb_get_geometry_reply_t *geo;
+    xcb_xinerama_screen_info_t *info;
+    xcb_window_t w, pw;
+    int i = 0, j, a, n = 0, area = 0;
+#endif
 
-        if (wait.tv_sec >= 0 && wait.tv_nsec >= 0) {
-            if (nanosleep(&wait, NULL) < 0 && errno != EINTR) {
-                die("nanosleep:");
-            }
-        }
+    mh = height;
+#ifdef XINERAMA
+    if (parentWin == root) {
+        /* none of these depends on another, one round trip for all */
+        screens_ck = xcb_xinerama_query_screens(c);
+        focus_ck = xcb_get_input_focus(c);
+        pointer_ck = xcb_query_pointer(c, root);
+        screens = xcb_xinerama_query_screens_reply(c, screens_ck, NULL);
+        focus = xcb_get_input_focus_reply(c, focus_ck, NULL);
+        pointer = xcb_query_pointer_reply(c, pointer_ck, NULL);
+        if (screens)
+            n = xcb_xinerama_query_screens_screen_info_length(screens);
     }
-}
-
-static void check_singleton(void) {
-    int pid_file = open("/tmp/daudio.pid", O_CREAT | O_RDWR, 0666);
-    struct timespec ts = {.tv_sec = 0, .tv_nsec = 100000};
-    int kill_attempts = 0;
-
-    if (pid_file < 0) {
-        die("error open '/tmp/daudio.pid' errno: %d", errno);
-    }
-    while (lockf(pid_file, F_TLOCK, 0) == -1) {
-        if (errno != EINTR) {
-            if (interactive) {
-                if (kill_attempts > 10) {
-                    die("failed to send SIGUSR1 to singleton after %d tries", kill_attempts);
-                }
-                // read pid from file
-                lseek(pid_file, 0, SEEK_SET);
-                size_t n = read(pid_file, buf, sizeof(buf));
-                buf[n] = '\0';
-                pid_t singleton_pid = strtol(buf, NULL, 10);
-
-                if (singleton_pid > 0) {
-                    // we could have a race condition where another process locked but not yet wrote it's pid, so we wait
-                    // send KILL signal to process
-                    int ret = kill(singleton_pid, SIGUSR1);
-                    if (ret == -1) {
-                        die("kill singleton");
+    if (n > 0) {
+        info = xcb_xinerama_query_screens_screen_info(screens);
+        w = focus ? focus->focus : None;
+        if (mon >= 0 && mon < n)
+            i = mon;
+        else if (w != root && w != PointerRoot && w != None) {
+            /* find top-level window containing current input focus, every
+             * step needs the parent from the step before */
+            do {
+                tree = xcb_query_tree_reply(c, xcb_query_tree(c, (pw = w)), NULL);
+                w = tree ? tree->parent : pw;
+                free(tree);
+            } while (w != root && w != pw);
+            /* find xinerama screen with which the window intersects most */
+            geo = xcb_get_geometry_reply(c, xcb_get_geometry(c, pw), NULL);
+            if (geo)
+                for (j = 0; j < n; j++)
+                    if ((a = INTERSECT(geo->x, geo->y, geo->width, geo->height, info[j])) > area) {
+                        area = a;
+                        i = j;
                     }
-                    exit(0);
-                }
-
-                // give other process time to write it's pid
-                kill_attempts++;
-                nanosleep(&ts, NULL);
-            } else {
-                exit(0);
-            }
+            free(geo);
         }
+        /* no focused window is on screen, so use pointer location instead */
+        if (mon < 0 && !area && pointer)
+            for (i = 0; i < n; i++)
+                if (INTERSECT(pointer->root_x, pointer->root_y, 1, 1, info[i]))
+                    break;
+
+        mw = MIN(MAX(width, 100), info[i].width);
+        x = info[i].x_org + ((info[i].width - mw) / 2);
+        y = info[i].y_org + ((info[i].height - mh) / 2);
     }
-    snprintf(buf, sizeof(buf), "%d", getpid());
-    write(pid_file, buf, strlen(buf) + 1);
+    free(screens);
+    free(focus);
+    free(pointer);
+    if (n <= 0)
+#endif
+    {
+        if (!window_size(parentWin, &ww, &wh))
+            die("could not get embedding window attributes: 0x%lx",
+                parentWin);
+        mw = MIN(MAX(width, 100), ww);
+        x = (ww - mw) / 2;
+        y = (wh - mh) / 2;
+    }
+    *px = x;
+    *py = y;
 }
-
-
-static void setup(void) {
-    int x, y, i, j;
+#else
+static void place(int *px, int *py) {
+    int x, y, ww, wh;
+#ifdef XINERAMA
+    int i, j, a, di, n, area = 0;
     unsigned int du;
-    XSetWindowAttributes swa;
-    XIM xim;
-    Window w, dw, *dws;
+    Window w, dw, pw, *dws;
     XWindowAttributes wa;
-    XClassHint ch = {"daudio", "daudio"};
-#ifdef XINERAMA
     XineramaScreenInfo *info;
-    Window pw;
-    int a, di, n, area = 0;
 #endif
 
-    /* init appearance */
-    for (j = 0; j < SchemeLast; j++) {
-        scheme[j] = drw_scm_create(drw, colors[j], 2);
-    }
-
-    /* calculate menu geometry */
-    bh = (int) drw->fonts->h + 2;
-    lrpad = (int) drw->fonts->h;
     mh = height;
 #ifdef XINERAMA
     i = 0;
@@ -507,15 +1065,334 @@ static void setup(void) {
     } else
 #endif
     {
-        if (!XGetWindowAttributes(dpy, parentWin, &wa))
+        if (!window_size(parentWin, &ww, &wh))
             die("could not get embedding window attributes: 0x%lx",
                 parentWin);
-        mw = MIN(MAX(width, 100), wa.width);
-        x = (wa.width - mw) / 2;
-        y = (wa.height - mh) / 2;
+        mw = MIN(MAX(width, 100), ww);
+        x = (ww - mw) / 2;
+        y = (wh - mh) / 2;
+    }
+    *px = x;
+    *py = y;
+}
+#endif
+
+/* Maps the window if it is hidden and redraws it. */
+static void show(void) {
+    int x, y;
+
+    if (!mapped) {
+        place(&x, &y);
+        XMoveResizeWindow(dpy, win, x, y, mw, mh);
+        drw_resize(drw, mw, mh);
+        painted = 0;
+        XMapRaised(dpy, win);
+        mapped = 1;
+    }
+    update_selected_sink();
+    draw();
+}
+
+static void update_numlockmask(void) {
+    unsigned int i, j;
+    XModifierKeymap *modmap;
+
+    numlockmask = 0;
+    modmap = XGetModifierMapping(dpy);
+    for (i = 0; i < 8; i++)
+        for (j = 0; j < modmap->max_keypermod; j++)
+            if (modmap->modifiermap[i * modmap->max_keypermod + j]
+                == XKeysymToKeycode(dpy, XK_Num_Lock))
+                numlockmask = (1 << i);
+    XFreeModifiermap(modmap);
+}
+
+static int xerror_grab(Display *d, XErrorEvent *ee) {
+    if (ee->error_code == BadAccess)
+        grab_failed = 1;
+    return 0;
+}
+
+/* Passively grabs media_keys on the root window, so the keys reach us even
+ * while the window is hidden and somebody else has the focus. */
+static void grab_media_keys(void) {
+    int (*xerror)(Display *, XErrorEvent *);
+    KeyCode code;
+
+    /* numlockmask is only known after this, the modifiers below need it */
+    update_numlockmask();
+    unsigned int i, j, modifiers[] = {0, LockMask, numlockmask, numlockmask | LockMask};
+
+    XUngrabKey(dpy, AnyKey, AnyModifier, root);
+    xerror = XSetErrorHandler(xerror_grab);
+    for (i = 0; i < LENGTH(media_keys); i++) {
+        if (!(code = XKeysymToKeycode(dpy, media_keys[i].keysym)))
+            continue;
+        for (j = 0; j < LENGTH(modifiers); j++)
+            XGrabKey(dpy, code, media_keys[i].mod | modifiers[j], root,
+                     True, GrabModeAsync, GrabModeAsync);
+    }
+    XSync(dpy, False);
+    XSetErrorHandler(xerror);
+    if (grab_failed)
+        fputs("warning: some media keys are grabbed by another client\n", stderr);
+}
+
+/* Handles a grabbed media key in-process, returns 0 if ev is none of them. */
+static int mediakey(XKeyEvent *ev) {
+    KeySym keysym;
+    CtlCommand c = {0};
+
+    if (!grabkeys)
+        return 0;
+    keysym = XLookupKeysym(ev, 0);
+    for (size_t i = 0; i < LENGTH(media_keys); i++) {
+        if (keysym == media_keys[i].keysym && CLEANMASK(media_keys[i].mod) == CLEANMASK(ev->state)) {
+            c.op = media_keys[i].op;
+            if (c.op == CtlInc || c.op == CtlDec) {
+                volume_steps += c.op == CtlInc ? 1 : -1;
+            } else {
+                execute_command(&c);
+            }
+            reveal = 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void handle_events(void) {
+    XEvent ev;
+
+    while (XPending(dpy) && !XNextEvent(dpy, &ev)) {
+        if (drw_present_event(drw, &ev)) {
+            redraw = redraw || frame_deferred;
+            continue;
+        }
+        if (ev.type == KeyPress && ev.xkey.window == root && mediakey(&ev.xkey))
+            continue;
+        if (XFilterEvent(&ev, win))
+            continue;
+        switch (ev.type) {
+            case FocusIn:
+                /* regrab focus from parent window */
+                if (ev.xfocus.window != win)
+                    grab_focus();
+                break;
+            case KeyPress:
+                keypress(&ev.xkey);
+                break;
+            case DestroyNotify:
+                if (ev.xdestroywindow.window != win)
+                    break;
+                exit(1);
+            case Expose:
+                if (ev.xexpose.count == 0)
+                    drw_map(drw, win, 0, 0, mw, mh);
+                break;
+            case VisibilityNotify:
+                if (ev.xvisibility.state != VisibilityUnobscured)
+                    XRaiseWindow(dpy, win);
+                break;
+        }
     }
 
-    /* create menu window */
+    /* autorepeat delivers keys faster than we draw, coalesce them into one
+     * volume target and one frame */
+    if (volume_steps) {
+        change_volume(volume_steps);
+        volume_steps = 0;
+    }
+    if (reveal) {
+        show();
+    } else if (redraw && mapped) {
+        draw();
+    }
+    redraw = reveal = 0;
+}
+
+static void handle_pulse_updates() {
+    uint64_t count;
+
+    /* the eventfd only wakes us up, the state itself comes from the snapshot */
+    if (read(get_pulse_fd(), &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        die("read pulse fd:");
+    }
+    if ((state = get_state())->generation != drawn_generation) {
+        update_selected_sink();
+        if (mapped)
+            draw();
+    }
+}
+
+static void handle_signals(void) {
+    struct signalfd_siginfo si;
+
+    while (read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+        switch (si.ssi_signo) {
+            case SIGINT:
+                exit(1);
+        }
+    }
+}
+
+static void handle_ctl(void) {
+    char request[256], reply[256], *line, *next;
+    CtlCommand c;
+    size_t len;
+    int fd, visible;
+
+    while ((fd = ctl_accept(ctl_fd)) >= 0) {
+        if (ctl_recv(fd, request, sizeof(request)) < 0) {
+            close(fd);
+            continue;
+        }
+        len = 0;
+        visible = 0;
+        reply[0] = '\0';
+        for (line = request; line && *line && len < sizeof(reply); line = next) {
+            if ((next = strchr(line, '\n')))
+                *next++ = '\0';
+            if (ctl_parse(line, &c) < 0)
+                len += snprintf(reply + len, sizeof(reply) - len, "error unknown command\n");
+            else if (execute_command(&c) < 0)
+                len += snprintf(reply + len, sizeof(reply) - len, "error %s\n",
+                                (state = get_state())->default_sink < 0 ? "no default sink"
+                                                                         : "invalid argument");
+            else if (c.op == CtlStats)
+                len += format_stats(reply + len, sizeof(reply) - len);
+            else {
+                len += format_status(reply + len, sizeof(reply) - len);
+                /* only a query leaves the window alone */
+                visible = visible || c.op != CtlQuery;
+            }
+        }
+        ctl_send(fd, reply);
+        close(fd);
+        if (visible)
+            show();
+    }
+}
+
+static void run(void) {
+    struct pollfd fds[FdLast];
+    uint64_t expirations;
+
+    fds[FdX].fd = ConnectionNumber(dpy);
+    fds[FdPulse].fd = get_pulse_fd();
+    fds[FdTimer].fd = timer_fd;
+    fds[FdSignal].fd = signal_fd;
+    fds[FdCtl].fd = ctl_fd;
+    for (int i = 0; i < FdLast; i++) {
+        fds[i].events = POLLIN;
+    }
+
+    for (;;) {
+        /* XPending flushes our output and drains events Xlib already queued,
+         * which poll would not report on the connection fd */
+        handle_events();
+
+        if (poll(fds, FdLast, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            die("poll:");
+        }
+
+        if (fds[FdSignal].revents & POLLIN) {
+            handle_signals();
+        }
+        if (fds[FdTimer].revents & POLLIN) {
+            if (read(timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+                quit();
+            }
+        }
+        if (fds[FdPulse].revents & POLLIN) {
+            handle_pulse_updates();
+        }
+        if (fds[FdCtl].revents & POLLIN) {
+            handle_ctl();
+        }
+    }
+}
+
+/* Hands the command line over to the running instance and exits. Returns
+ * only if the instance went away before it answered. */
+static void forward(void) {
+    char request[256], reply[256];
+
+    snprintf(request, sizeof(request), "%s\n%s", cmd ? cmd : "show", interactive ? "interactive\n" : "");
+    if (ctl_transact(request, reply, sizeof(reply)) <= 0) {
+        return;
+    }
+    if (strstr(reply, "error")) {
+        fputs(reply, stderr);
+        exit(1);
+    }
+    exit(0);
+}
+
+
+static void open_input_method(void) {
+    XIM xim;
+
+    if ((xim = XOpenIM(dpy, NULL, NULL, NULL)) == NULL)
+        die("XOpenIM failed: could not open input device");
+
+    xic = XCreateIC(xim, XNInputStyle, XIMPreeditNothing | XIMStatusNothing,
+                    XNClientWindow, win, XNFocusWindow, win, NULL);
+}
+
+/* Creates and maps the menu window, embedded into parentWin with -w. */
+#ifdef XCB
+/* The children of the embedding window are asked for before the input
+ * method is opened and read afterwards, its round trips hide this one. */
+static void create_window(int x, int y) {
+    static const char class[] = "daudio\0daudio";
+    xcb_connection_t *c = XGetXCBConnection(dpy);
+    uint32_t values[] = {scheme[SchemeNorm][ColBg].pixel, 1,
+                         XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_KEY_PRESS | XCB_EVENT_MASK_VISIBILITY_CHANGE};
+    uint32_t above = XCB_STACK_MODE_ABOVE, focus_mask = XCB_EVENT_MASK_FOCUS_CHANGE,
+             parent_mask = XCB_EVENT_MASK_FOCUS_CHANGE | XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY;
+    xcb_query_tree_cookie_t tree_ck = {0};
+    xcb_query_tree_reply_t *tree;
+    xcb_window_t *children;
+    int i, n;
+
+    win = xcb_generate_id(c);
+    xcb_create_window(c, XCB_COPY_FROM_PARENT, win, parentWin, x, y, mw, mh, 0,
+                      XCB_WINDOW_CLASS_COPY_FROM_PARENT, XCB_COPY_FROM_PARENT,
+                      XCB_CW_BACK_PIXEL | XCB_CW_OVERRIDE_REDIRECT | XCB_CW_EVENT_MASK, values);
+    xcb_change_property(c, XCB_PROP_MODE_REPLACE, win, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 8,
+                        sizeof(class), class);
+
+    /* a resident instance started without a command waits hidden for a trigger */
+    if (!resident || interactive || cmd) {
+        xcb_configure_window(c, win, XCB_CONFIG_WINDOW_STACK_MODE, &above);
+        xcb_map_window(c, win);
+        mapped = 1;
+    }
+    if (embed) {
+        xcb_change_window_attributes(c, parentWin, XCB_CW_EVENT_MASK, &parent_mask);
+        tree_ck = xcb_query_tree(c, parentWin);
+    }
+
+    open_input_method();
+
+    if (embed && (tree = xcb_query_tree_reply(c, tree_ck, NULL))) {
+        children = xcb_query_tree_children(tree);
+        n = xcb_query_tree_children_length(tree);
+        for (i = 0; i < n && children[i] != win; ++i)
+            xcb_change_window_attributes(c, children[i], XCB_CW_EVENT_MASK, &focus_mask);
+        free(tree);
+    }
+}
+#else
+static void create_window(int x, int y) {
+    unsigned int du, i;
+    XSetWindowAttributes swa;
+    Window w, dw, *dws;
+    XClassHint ch = {"daudio", "daudio"};
+
     swa.override_redirect = True;
     swa.background_pixel = scheme[SchemeNorm][ColBg].pixel;
     swa.event_mask = ExposureMask | KeyPressMask | VisibilityChangeMask;
@@ -524,15 +1401,13 @@ static void setup(void) {
                         CWOverrideRedirect | CWBackPixel | CWEventMask, &swa);
     XSetClassHint(dpy, win, &ch);
 
+    open_input_method();
 
-    /* input methods */
-    if ((xim = XOpenIM(dpy, NULL, NULL, NULL)) == NULL)
-        die("XOpenIM failed: could not open input device");
-
-    xic = XCreateIC(xim, XNInputStyle, XIMPreeditNothing | XIMStatusNothing,
-                    XNClientWindow, win, XNFocusWindow, win, NULL);
-
-    XMapRaised(dpy, win);
+    /* a resident instance started without a command waits hidden for a trigger */
+    if (!resident || interactive || cmd) {
+        XMapRaised(dpy, win);
+        mapped = 1;
+    }
     if (embed) {
         XSelectInput(dpy, parentWin, FocusChangeMask | SubstructureNotifyMask);
         if (XQueryTree(dpy, parentWin, &dw, &w, &dws, &du) && dws) {
@@ -541,23 +1416,106 @@ static void setup(void) {
             XFree(dws);
         }
     }
+}
+#endif
+
+static void setup(void) {
+    int x, y, j;
+
+    /* init appearance */
+    for (j = 0; j < SchemeLast; j++) {
+        scheme[j] = drw_scm_create(drw, colors[j], 2);
+    }
+
+    /* calculate menu geometry */
+    bh = (int) drw->fonts->h + 2;
+    lrpad = (int) drw->fonts->h;
+    place(&x, &y);
+    create_window(x, y);
 
     drw_resize(drw, mw, mh);
-    draw();
+    if (mapped)
+        draw();
 
+    if (grabkeys)
+        grab_media_keys();
     setup_interactive();
+    startup_roundtrips = roundtrip_count();
+}
+
+/* -q: runs the command against pulse directly, waits until the server
+ * acknowledged it and prints the result. X is never opened. */
+static int run_headless(void) {
+    struct timespec start, end, rtt;
+    char line[256], reply[256];
+    CtlCommand c;
+    int failed;
+
+    if (cmd == NULL) {
+        die("-q needs -cmd");
+    }
+    strlcpy(line, cmd, sizeof(line));
+    if (ctl_parse(line, &c) < 0 || c.op == CtlShow || c.op == CtlInteractive) {
+        die("invalid command: %s", cmd);
+    }
+
+    setup_pulse(sink_fetch_delay);
+    wait_for_default_sink();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (execute_command(&c) < 0) {
+        die("invalid command: %s", cmd);
+    }
+    pulse_lock();
+    failed = wait_for_ops();
+    pulse_unlock();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (c.op == CtlStats) {
+        format_stats(reply, sizeof(reply));
+    } else {
+        format_status(reply, sizeof(reply));
+    }
+    fputs(failed ? "error operation failed\n" : reply, failed ? stderr : stdout);
+    if (report_rtt) {
+        timespec_diff(&rtt, &end, &start);
+        fprintf(stderr, "rtt %ld.%03ldms\n", (long) rtt.tv_sec * 1000 + rtt.tv_nsec / 1000000,
+                (rtt.tv_nsec / 1000) % 1000);
+    }
+    free_pulse();
+    return failed ? 1 : 0;
+}
+
+/* $XDG_CACHE_HOME/daudio/fonts, or ~/.cache/daudio/fonts */
+static void open_font_cache(void) {
+    char path[4096];
+    const char *base = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+
+    if (base && *base)
+        snprintf(path, sizeof(path), "%s", base);
+    else if (home && *home)
+        snprintf(path, sizeof(path), "%s/.cache", home);
+    else
+        return;
+    mkdir(path, 0700);
+    strncat(path, "/daudio", sizeof(path) - strlen(path) - 1);
+    if (mkdir(path, 0700) < 0 && errno != EEXIST)
+        return;
+    strncat(path, "/fonts", sizeof(path) - strlen(path) - 1);
+    fontcache_open(path);
 }
 
 static void usage(void) {
-    fputs("usage:  daudio [-iv] [-cmd inc|dec|toggle] [-m monitor] [-fn font] ["
-          "-nb color] [-nf color] [-sb color] [-sf color] [-mb color] [-mf color] [-w windowid]\n", stderr);
+    fputs("usage:  daudio [-dgiqtv] [-cmd inc|dec|toggle] [-m monitor] [-fn font] ["
+          "-nb color] [-nf color] [-sb color] [-sf color] [-mb color] [-mf color] [-w windowid] [-mock sinks]\n"
+          "        [-record file] [-replay file]\n", stderr);
     exit(1);
 }
 
 int main(int argc, char *argv[]) {
-    XWindowAttributes wa;
-    int i;
-    struct sigaction sa;
+    int i, ww, wh, mock = 0;
+    char *record = NULL, *replay = NULL;
+    sigset_t mask;
 
     interactive = 0;
     for (i = 1; i < argc; i++) {
@@ -569,6 +1527,14 @@ int main(int argc, char *argv[]) {
             exit(0);
         } else if (!strcmp(argv[i], "-i"))
             interactive = 1;
+        else if (!strcmp(argv[i], "-d"))   /* stay resident, hide instead of exiting */
+            resident = 1;
+        else if (!strcmp(argv[i], "-g"))   /* grab media keys on the root window */
+            grabkeys = 1;
+        else if (!strcmp(argv[i], "-q"))   /* headless, acknowledged -cmd */
+            headless = 1;
+        else if (!strcmp(argv[i], "-t"))   /* report the round trip time with -q */
+            report_rtt = 1;
         else if (i + 1 == argc)
             usage();
             /* these options take one argument */
@@ -592,25 +1558,56 @@ int main(int argc, char *argv[]) {
             colors[SchemeMuted][ColBg] = argv[++i];
         else if (!strcmp(argv[i], "-w"))   /* embedding window id */
             embed = argv[++i];
+        else if (!strcmp(argv[i], "-mock")) { /* in process backend with n sinks */
+            mock_configure((int) strtol(argv[++i], NULL, 10), mock_latency);
+            use_backend(&mock_backend);
+            mock = 1;
+        }
+        else if (!strcmp(argv[i], "-record")) /* log the pulse callbacks to a file */
+            record = argv[++i];
+        else if (!strcmp(argv[i], "-replay")) /* play such a log back instead of pulse */
+            replay = argv[++i];
 
         else
             usage();
     }
+    /* the recording lives in the pulse backend, the mock never sees it */
+    if (mock && (record || replay))
+        die("-mock cannot be combined with -record or -replay");
+    if (record)
+        pulse_record(record);
+    if (replay)
+        pulse_replay(replay, 1);
+
+    if (headless)
+        return run_headless();
+
+    /* binding the control socket is the singleton lock, everybody else only
+     * forwards its command and never touches pulse or X */
+    for (i = 0; (ctl_fd = ctl_listen()) < 0; i++) {
+        if (i == 10)
+            die("cannot reach the running instance");
+        forward();
+    }
 
     int e = atexit(cleanup);
     if (e != 0) {
         die("cannot set exit function");
     }
 
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = exit;
-    sigaction(SIGINT, &sa, NULL);
-    sa.sa_handler = handle_sigusr1;
-    sigaction(SIGUSR1, &sa, NULL);
-
-    setup_pulse();
+    /* signals are read from a signalfd in run(); block them before the pulse
+     * thread is started so it inherits the mask */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
+        die("sigprocmask:");
+    if ((signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+        die("signalfd:");
+    if ((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+        die("timerfd_create:");
+
+    setup_pulse(sink_fetch_delay);
     execute_cli_command();
-    check_singleton();
 
     if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
         fputs("warning: no locale support\n", stderr);
@@ -620,10 +1617,12 @@ int main(int argc, char *argv[]) {
     root = RootWindow(dpy, screen);
     if (!embed || !(parentWin = strtol(embed, NULL, 0)))
         parentWin = root;
-    if (!XGetWindowAttributes(dpy, parentWin, &wa))
+    if (!window_size(parentWin, &ww, &wh))
         die("could not get embedding window attributes: 0x%lx",
             parentWin);
-    drw = drw_create(dpy, screen, root, wa.width, wa.height);
+    drw = drw_create(dpy, screen, root, ww, wh);
+    if (font_cache)
+        open_font_cache();
     if (!drw_fontset_create(drw, fonts, LENGTH(fonts)))
         die("no fonts could be loaded.");
 
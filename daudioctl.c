@@ -0,0 +1,62 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ctl.h"
+#include "util.h"
+
+/* Minimal client for a running daudio. It only speaks the control protocol
+ * and links nothing but libc, so a media key binding pays for one exec and
+ * one socket round trip. */
+
+static void
+usage(void)
+{
+	fputs("usage: daudioctl [-v] inc|dec|toggle|query|stats|show|interactive|set percent|sink name\n", stderr);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char request[256], line[256], reply[256];
+	CtlCommand c;
+	size_t len = 0;
+	int i, n;
+
+	if (argc == 2 && !strcmp(argv[1], "-v")) {
+		puts("daudioctl-"VERSION);
+		exit(0);
+	}
+	if (argc < 2)
+		usage();
+
+	/* "daudioctl sink some name" sends "sink some name" */
+	for (i = 1; i < argc && len < sizeof(request) - 1; i++)
+		len += snprintf(request + len, sizeof(request) - len, "%s%s", i > 1 ? " " : "", argv[i]);
+	strlcpy(line, request, sizeof(line));
+	if (ctl_parse(line, &c) < 0)
+		usage();
+	len = MIN(len, sizeof(request) - 2);
+	request[len++] = '\n';
+	request[len] = '\0';
+
+	if ((n = ctl_transact(request, reply, sizeof(reply))) > 0) {
+		if (!strncmp(reply, "error", 5)) {
+			fputs(reply, stderr);
+			exit(1);
+		}
+		if (c.op == CtlQuery || c.op == CtlStats)
+			fputs(reply, stdout);
+		exit(0);
+	}
+
+	/* nobody is listening */
+	if (c.op == CtlQuery || c.op == CtlStats)
+		die("daudioctl: no running instance");
+	request[len - 1] = '\0';
+	execlp("daudio", "daudio", "-cmd", request, (char *)NULL);
+	die("daudioctl: cannot exec daudio:");
+}
@@ -1,15 +1,27 @@
 /* See LICENSE file for copyright and license details. */
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <X11/Xlib.h>
 #include <X11/Xft/Xft.h>
+#ifdef PRESENT
+#include <X11/extensions/Xpresent.h>
+#endif
+#ifdef XCB
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcbext.h>
+#endif
 
 #include "drw.h"
+#include "fontcache.h"
 #include "util.h"
 
 #define UTF_INVALID 0xFFFD
 #define UTF_SIZ     4
+#define FALLBACK_MAX 8  /* fallback fonts loaded for missing glyphs */
+
+static void glyphs_clear(Drw *drw);
 
 static const unsigned char utfbyte[UTF_SIZ + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
 static const unsigned char utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
@@ -60,6 +72,192 @@ utf8decode(const char *c, long *u, size_t clen)
 	return len;
 }
 
+/* Software renderer: without a display drw_create() draws into ARGB buffers
+ * in memory and renders text with FreeType, so drawing can be measured and
+ * compared without an X server. Drawables are indices into drw->bufs. */
+static SoftBuf *
+soft_buf(Drw *drw, Drawable d)
+{
+	if (!d || d > drw->nbufs || !drw->bufs[d - 1].px)
+		die("invalid drawable: %lu", d);
+	return &drw->bufs[d - 1];
+}
+
+static Drawable
+soft_buf_create(Drw *drw, unsigned int w, unsigned int h)
+{
+	unsigned int i;
+
+	for (i = 0; i < drw->nbufs && drw->bufs[i].px; i++)
+		; /* NOP */
+	if (i == drw->nbufs && !(drw->bufs = realloc(drw->bufs, ++drw->nbufs * sizeof(SoftBuf))))
+		die("realloc:");
+	drw->bufs[i].w = w;
+	drw->bufs[i].h = h;
+	drw->bufs[i].px = ecalloc(MAX(w * h, 1), sizeof(uint32_t));
+	return i + 1;
+}
+
+static void
+soft_buf_free(Drw *drw, Drawable d)
+{
+	SoftBuf *b = soft_buf(drw, d);
+
+	free(b->px);
+	b->px = NULL;
+}
+
+static void
+soft_fill(SoftBuf *b, int x, int y, unsigned int w, unsigned int h, uint32_t c)
+{
+	int x1 = MIN(x + (int)w, (int)b->w), y1 = MIN(y + (int)h, (int)b->h), i;
+
+	for (y = MAX(y, 0); y < y1; y++)
+		for (i = MAX(x, 0); i < x1; i++)
+			b->px[y * b->w + i] = c;
+}
+
+static void
+soft_copy(SoftBuf *src, int sx, int sy, unsigned int w, unsigned int h, SoftBuf *dst, int dx, int dy)
+{
+	int x0 = MAX(0, MAX(-sx, -dx)), y0 = MAX(0, MAX(-sy, -dy)), y;
+	int x1 = MIN((int)w, MIN((int)src->w - sx, (int)dst->w - dx));
+	int y1 = MIN((int)h, MIN((int)src->h - sy, (int)dst->h - dy));
+
+	for (y = y0; y < y1 && x0 < x1; y++)
+		memmove(&dst->px[(dy + y) * dst->w + dx + x0], &src->px[(sy + y) * src->w + sx + x0],
+		        (x1 - x0) * sizeof(uint32_t));
+}
+
+/* src over dst with coverage a, both opaque */
+static uint32_t
+soft_blend(uint32_t dst, uint32_t src, unsigned int a)
+{
+	a += a >> 7;
+	return 0xff000000
+	       | (((src & 0xff00ff) * a + (dst & 0xff00ff) * (256 - a)) >> 8 & 0xff00ff)
+	       | (((src & 0xff00) * a + (dst & 0xff00) * (256 - a)) >> 8 & 0xff00);
+}
+
+/* Renders a glyph once, failures are kept as empty glyphs. */
+static SoftGlyph *
+soft_glyph(Fnt *font, long codepoint)
+{
+	SoftGlyph *g, **bucket = &font->glyphs[codepoint & (SOFT_GLYPH_BUCKETS - 1)];
+	FT_GlyphSlot slot = font->face->glyph;
+	FT_Bitmap *bm = &slot->bitmap;
+	unsigned int x, y;
+
+	for (g = *bucket; g; g = g->next)
+		if (g->codepoint == codepoint)
+			return g;
+
+	g = ecalloc(1, sizeof(SoftGlyph));
+	g->codepoint = codepoint;
+	g->next = *bucket;
+	*bucket = g;
+	if (FT_Load_Char(font->face, codepoint, FT_LOAD_RENDER))
+		return g;
+	g->left = slot->bitmap_left;
+	g->top = slot->bitmap_top;
+	g->advance = (slot->advance.x + 32) >> 6;
+	g->w = bm->width;
+	g->h = bm->rows;
+	g->bitmap = ecalloc(MAX(g->w * g->h, 1), 1);
+	for (y = 0; y < g->h; y++)
+		for (x = 0; x < g->w; x++)
+			g->bitmap[y * g->w + x] = bm->pixel_mode == FT_PIXEL_MODE_MONO
+				? (bm->buffer[y * bm->pitch + x / 8] & (0x80 >> x % 8) ? 255 : 0)
+				: bm->buffer[y * bm->pitch + x];
+	return g;
+}
+
+static unsigned int
+soft_extents(Fnt *font, const char *text, size_t len)
+{
+	unsigned int w = 0;
+	size_t n;
+	long u;
+
+	for (; len && (n = utf8decode(text, &u, len)); text += n, len -= n)
+		w += soft_glyph(font, u)->advance;
+	return w;
+}
+
+static void
+soft_text(SoftBuf *b, Fnt *font, int x, int y, const char *text, size_t len, uint32_t c)
+{
+	SoftGlyph *g;
+	unsigned int a;
+	int gx, gy, px, py;
+	size_t n;
+	long u;
+
+	for (; len && (n = utf8decode(text, &u, len)); text += n, len -= n) {
+		g = soft_glyph(font, u);
+		for (gy = 0; gy < (int)g->h; gy++) {
+			if ((py = y - g->top + gy) < 0 || py >= (int)b->h)
+				continue;
+			for (gx = 0; gx < (int)g->w; gx++) {
+				px = x + g->left + gx;
+				if (px >= 0 && px < (int)b->w && (a = g->bitmap[gy * g->w + gx]))
+					b->px[py * b->w + px] = soft_blend(b->px[py * b->w + px], c, a);
+			}
+		}
+		x += g->advance;
+	}
+}
+
+/* Only #rgb and #rrggbb, named colors need the server */
+static void
+soft_clr_create(Clr *dest, const char *clrname)
+{
+	size_t n = strlen(clrname);
+	unsigned long rgb;
+	char *end;
+
+	if (clrname[0] != '#' || (n != 4 && n != 7))
+		die("error, cannot allocate color '%s'", clrname);
+	rgb = strtoul(clrname + 1, &end, 16);
+	if (*end)
+		die("error, cannot allocate color '%s'", clrname);
+	if (n == 4)
+		rgb = (rgb & 0xf00) * 0x1100 | (rgb & 0xf0) * 0x110 | (rgb & 0xf) * 0x11;
+	dest->pixel = 0xff000000 | rgb;
+	dest->color.red = (rgb >> 16 & 0xff) * 0x101;
+	dest->color.green = (rgb >> 8 & 0xff) * 0x101;
+	dest->color.blue = (rgb & 0xff) * 0x101;
+	dest->color.alpha = 0xffff;
+}
+
+static Fnt *
+soft_font_open(Drw *drw, FcPattern *match)
+{
+	FcChar8 *file;
+	FT_Face face;
+	Fnt *font;
+	double size;
+	int index = 0;
+
+	if (FcPatternGetString(match, FC_FILE, 0, &file) != FcResultMatch)
+		return NULL;
+	FcPatternGetInteger(match, FC_INDEX, 0, &index);
+	if (FcPatternGetDouble(match, FC_PIXEL_SIZE, 0, &size) != FcResultMatch)
+		size = 12;
+	if (!drw->ft && FT_Init_FreeType(&drw->ft))
+		die("cannot initialize freetype");
+	if (FT_New_Face(drw->ft, (const char *)file, index, &face))
+		return NULL;
+	FT_Set_Pixel_Sizes(face, 0, (FT_UInt)(size + 0.5));
+
+	font = ecalloc(1, sizeof(Fnt));
+	font->face = face;
+	font->match = match;
+	font->ascent = (face->size->metrics.ascender + 63) >> 6;
+	font->h = font->ascent + ((-face->size->metrics.descender + 63) >> 6);
+	return font;
+}
+
 Drw *
 drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h)
 {
@@ -70,9 +268,17 @@ drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h
 	drw->root = root;
 	drw->w = w;
 	drw->h = h;
+	if (!dpy) {
+		drw->drawable = soft_buf_create(drw, w, h);
+		return drw;
+	}
 	drw->drawable = XCreatePixmap(dpy, root, w, h, DefaultDepth(dpy, screen));
 	drw->gc = XCreateGC(dpy, root, 0, NULL);
 	XSetLineAttributes(dpy, drw->gc, 1, LineSolid, CapButt, JoinMiter);
+#ifdef PRESENT
+	int event, error;
+	drw->present = XPresentQueryExtension(dpy, &drw->present_opcode, &event, &error);
+#endif
 
 	return drw;
 }
@@ -85,28 +291,202 @@ drw_resize(Drw *drw, unsigned int w, unsigned int h)
 
 	drw->w = w;
 	drw->h = h;
+	if (!drw->dpy) {
+		soft_buf_free(drw, drw->drawable);
+		drw->drawable = soft_buf_create(drw, w, h);
+		return;
+	}
 	if (drw->drawable)
 		XFreePixmap(drw->dpy, drw->drawable);
 	drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
 }
 
+/* Offscreen pixmaps matching the drawable, drawn to after drw_settarget() */
+Pixmap
+drw_pixmap_create(Drw *drw, unsigned int w, unsigned int h)
+{
+	if (!drw->dpy)
+		return soft_buf_create(drw, w, h);
+	return XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
+}
+
+void
+drw_pixmap_free(Drw *drw, Pixmap pixmap)
+{
+	if (drw && pixmap && !drw->dpy)
+		soft_buf_free(drw, pixmap);
+	else if (drw && pixmap)
+		XFreePixmap(drw->dpy, pixmap);
+}
+
+/* Redirects all drawing to d and returns the previous target. Restore it
+ * before drw_resize() or drw_map(). */
+Drawable
+drw_settarget(Drw *drw, Drawable d)
+{
+	Drawable old = drw->drawable;
+
+	drw->drawable = d;
+	return old;
+}
+
+/* Copies from src into the drawable, server side */
+void
+drw_copy(Drw *drw, Drawable src, int sx, int sy, unsigned int w, unsigned int h, int dx, int dy)
+{
+	if (drw && !drw->dpy)
+		soft_copy(soft_buf(drw, src), sx, sy, w, h, soft_buf(drw, drw->drawable), dx, dy);
+	else if (drw)
+		XCopyArea(drw->dpy, src, drw->drawable, drw->gc, sx, sy, w, h, dx, dy);
+}
+
+/* The drawn pixels of the software renderer, NULL with a display */
+const uint32_t *
+drw_pixels(Drw *drw, unsigned int *w, unsigned int *h)
+{
+	SoftBuf *b;
+
+	if (!drw || drw->dpy)
+		return NULL;
+	b = soft_buf(drw, drw->drawable);
+	if (w)
+		*w = b->w;
+	if (h)
+		*h = b->h;
+	return b->px;
+}
+
 void
 drw_free(Drw *drw)
 {
-	XFreePixmap(drw->dpy, drw->drawable);
-	XFreeGC(drw->dpy, drw->gc);
+	unsigned int i;
+
+	drw_text_invalidate(drw, NULL);
+	glyphs_clear(drw);
+#ifdef XCB
+	if (drw->syncing)
+		xcb_discard_reply(XGetXCBConnection(drw->dpy), drw->sync);
+#endif
+	if (drw->dpy) {
+		XFreePixmap(drw->dpy, drw->drawable);
+		XFreeGC(drw->dpy, drw->gc);
+	}
 	drw_fontset_free(drw->fonts);
+	for (i = 0; i < drw->nbufs; i++)
+		free(drw->bufs[i].px);
+	free(drw->bufs);
+	if (drw->ft)
+		FT_Done_FreeType(drw->ft);
 	free(drw);
 }
 
+/* Stores a resolved pattern in the font cache. Charset and languages are
+ * left out, Xft takes them from the face when it is opened. */
+static void
+cache_pattern(const char *kind, const char *key, FcPattern *match)
+{
+	FcPattern *p;
+	FcChar8 *s;
+
+	if (!match) {
+		fontcache_put(kind, key, "-");
+		return;
+	}
+	p = FcPatternDuplicate(match);
+	FcPatternDel(p, FC_CHARSET);
+	FcPatternDel(p, FC_LANG);
+	if ((s = FcNameUnparse(p))) {
+		fontcache_put(kind, key, (char *)s);
+		free(s);
+	}
+	FcPatternDestroy(p);
+}
+
+/* Opens a resolved pattern and owns it on success, like XftFontOpenPattern() */
+static Fnt *
+font_open(Drw *drw, FcPattern *match)
+{
+	XftFont *xfont;
+	Fnt *font;
+
+	if (!drw->dpy)
+		return soft_font_open(drw, match);
+	if (!(xfont = XftFontOpenPattern(drw->dpy, match)))
+		return NULL;
+	font = ecalloc(1, sizeof(Fnt));
+	font->xfont = xfont;
+	font->ascent = xfont->ascent;
+	font->h = xfont->ascent + xfont->descent;
+	font->dpy = drw->dpy;
+	return font;
+}
+
+static FcPattern *
+font_match(Drw *drw, FcPattern *pattern)
+{
+	FcResult result;
+
+	if (drw->dpy)
+		return XftFontMatch(drw->dpy, drw->screen, pattern, &result);
+	FcConfigSubstitute(NULL, pattern, FcMatchPattern);
+	FcDefaultSubstitute(pattern);
+	return FcFontMatch(NULL, pattern, &result);
+}
+
+/* Same as XftFontOpenName() */
+static Fnt *
+font_open_name(Drw *drw, const char *fontname)
+{
+	FcPattern *pattern, *match;
+	Fnt *font = NULL;
+
+	if (!(pattern = FcNameParse((FcChar8 *)fontname)))
+		return NULL;
+	if ((match = font_match(drw, pattern)) && !(font = font_open(drw, match)))
+		FcPatternDestroy(match);
+	FcPatternDestroy(pattern);
+	return font;
+}
+
+/* The resolved pattern a font was opened from */
+static FcPattern *
+font_pattern(Fnt *font)
+{
+	return font->xfont ? font->xfont->pattern : font->match;
+}
+
+static int
+font_has(Drw *drw, Fnt *font, long codepoint)
+{
+	if (font->xfont)
+		return XftCharExists(drw->dpy, font->xfont, codepoint);
+	return FT_Get_Char_Index(font->face, codepoint) != 0;
+}
+
+/* Opens a font from a pattern the cache resolved in an earlier run. */
+static Fnt *
+cached_open(Drw *drw, const char *kind, const char *key)
+{
+	const char *cached = fontcache_get(kind, key);
+	FcPattern *resolved;
+	Fnt *font;
+
+	if (!cached || !(resolved = FcNameParse((FcChar8 *)cached)))
+		return NULL;
+	if (!(font = font_open(drw, resolved)))
+		FcPatternDestroy(resolved);
+	return font;
+}
+
+static void xfont_free(Fnt *font);
+
 /* This function is an implementation detail. Library users should use
  * drw_fontset_create instead.
  */
 static Fnt *
 xfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern)
 {
-	Fnt *font;
-	XftFont *xfont = NULL;
+	Fnt *font = NULL;
 	FcPattern *pattern = NULL;
 
 	if (fontname) {
@@ -115,17 +495,20 @@ xfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern)
 		 * FcNameParse; using the latter results in the desired fallback
 		 * behaviour whereas the former just results in missing-character
 		 * rectangles being drawn, at least with some fonts. */
-		if (!(xfont = XftFontOpenName(drw->dpy, drw->screen, fontname))) {
-			fprintf(stderr, "error, cannot load font from name: '%s'\n", fontname);
-			return NULL;
+		if (!(font = cached_open(drw, "font", fontname))) {
+			if (!(font = font_open_name(drw, fontname))) {
+				fprintf(stderr, "error, cannot load font from name: '%s'\n", fontname);
+				return NULL;
+			}
+			cache_pattern("font", fontname, font_pattern(font));
 		}
 		if (!(pattern = FcNameParse((FcChar8 *) fontname))) {
 			fprintf(stderr, "error, cannot parse font name to pattern: '%s'\n", fontname);
-			XftFontClose(drw->dpy, xfont);
+			xfont_free(font);
 			return NULL;
 		}
 	} else if (fontpattern) {
-		if (!(xfont = XftFontOpenPattern(drw->dpy, fontpattern))) {
+		if (!(font = font_open(drw, fontpattern))) {
 			fprintf(stderr, "error, cannot load font from pattern.\n");
 			return NULL;
 		}
@@ -141,31 +524,54 @@ xfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern)
 	 * and lots more all over the internet.
 	 */
 	FcBool iscol;
-	if(FcPatternGetBool(xfont->pattern, FC_COLOR, 0, &iscol) == FcResultMatch && iscol) {
-		XftFontClose(drw->dpy, xfont);
+	font->pattern = pattern;
+	if(FcPatternGetBool(font_pattern(font), FC_COLOR, 0, &iscol) == FcResultMatch && iscol) {
+		xfont_free(font);
 		return NULL;
 	}
 
-	font = ecalloc(1, sizeof(Fnt));
-	font->xfont = xfont;
-	font->pattern = pattern;
-	font->h = xfont->ascent + xfont->descent;
-	font->dpy = drw->dpy;
-
 	return font;
 }
 
 static void
 xfont_free(Fnt *font)
 {
+	SoftGlyph *g;
+	size_t i;
+
 	if (!font)
 		return;
 	if (font->pattern)
 		FcPatternDestroy(font->pattern);
-	XftFontClose(font->dpy, font->xfont);
+	if (font->xfont) {
+		XftFontClose(font->dpy, font->xfont);
+	} else {
+		for (i = 0; i < SOFT_GLYPH_BUCKETS; i++)
+			while ((g = font->glyphs[i])) {
+				font->glyphs[i] = g->next;
+				free(g->bitmap);
+				free(g);
+			}
+		FT_Done_Face(font->face);
+		FcPatternDestroy(font->match);
+	}
 	free(font);
 }
 
+/* Everything cached about glyphs and layouts belongs to one font set. */
+static void
+fontset_attach(Drw *drw, Fnt *set)
+{
+	Fnt *cur;
+
+	drw_text_invalidate(drw, NULL);
+	glyphs_clear(drw);
+	drw->fonts = set;
+	drw->nfallback = 0;
+	for (drw->nfonts = 0, cur = set; cur; cur = cur->next)
+		drw->nfonts++;
+}
+
 Fnt*
 drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 {
@@ -181,7 +587,8 @@ drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 			ret = cur;
 		}
 	}
-	return (drw->fonts = ret);
+	fontset_attach(drw, ret);
+	return ret;
 }
 
 void
@@ -199,7 +606,9 @@ drw_clr_create(Drw *drw, Clr *dest, const char *clrname)
 	if (!drw || !dest || !clrname)
 		return;
 
-	if (!XftColorAllocName(drw->dpy, DefaultVisual(drw->dpy, drw->screen),
+	if (!drw->dpy)
+		soft_clr_create(dest, clrname);
+	else if (!XftColorAllocName(drw->dpy, DefaultVisual(drw->dpy, drw->screen),
 	                       DefaultColormap(drw->dpy, drw->screen),
 	                       clrname, dest))
 		die("error, cannot allocate color '%s'", clrname);
@@ -225,8 +634,8 @@ drw_scm_create(Drw *drw, const char *clrnames[], size_t clrcount)
 void
 drw_setfontset(Drw *drw, Fnt *set)
 {
-	if (drw)
-		drw->fonts = set;
+	if (drw && drw->fonts != set)
+		fontset_attach(drw, set);
 }
 
 void
@@ -239,8 +648,24 @@ drw_setscheme(Drw *drw, Clr *scm)
 void
 drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int invert)
 {
+	SoftBuf *b;
+	uint32_t c;
+
 	if (!drw || !drw->scheme)
 		return;
+	if (!drw->dpy) {
+		b = soft_buf(drw, drw->drawable);
+		c = invert ? drw->scheme[ColBg].pixel : drw->scheme[ColFg].pixel;
+		if (filled) {
+			soft_fill(b, x, y, w, h, c);
+		} else {
+			soft_fill(b, x, y, w, 1, c);
+			soft_fill(b, x, y + h - 1, w, 1, c);
+			soft_fill(b, x, y, 1, h, c);
+			soft_fill(b, x + w - 1, y, 1, h, c);
+		}
+		return;
+	}
 	XSetForeground(drw->dpy, drw->gc, invert ? drw->scheme[ColBg].pixel : drw->scheme[ColFg].pixel);
 	if (filled)
 		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
@@ -248,145 +673,445 @@ drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int
 		XDrawRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w - 1, h - 1);
 }
 
-int
-drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert)
+static GlyphFont *
+glyph_slot(Drw *drw, long codepoint)
+{
+	unsigned int i = (unsigned long)codepoint * 2654435761u & (drw->glyphs_cap - 1);
+
+	while (drw->glyphs[i].used && drw->glyphs[i].codepoint != codepoint)
+		i = (i + 1) & (drw->glyphs_cap - 1);
+	return &drw->glyphs[i];
+}
+
+static GlyphFont *
+glyph_insert(Drw *drw, long codepoint)
+{
+	GlyphFont *old = drw->glyphs, *g;
+	unsigned int i, cap = drw->glyphs_cap;
+
+	if (2 * (drw->nglyphs + 1) > drw->glyphs_cap) {
+		drw->glyphs_cap = cap ? cap * 2 : 64;
+		drw->glyphs = ecalloc(drw->glyphs_cap, sizeof(GlyphFont));
+		for (i = 0; i < cap; i++)
+			if (old[i].used)
+				*glyph_slot(drw, old[i].codepoint) = old[i];
+		free(old);
+	}
+	g = glyph_slot(drw, codepoint);
+	g->used = 1;
+	g->codepoint = codepoint;
+	drw->nglyphs++;
+	return g;
+}
+
+static void
+glyphs_clear(Drw *drw)
+{
+	free(drw->glyphs);
+	drw->glyphs = NULL;
+	drw->nglyphs = drw->glyphs_cap = 0;
+}
+
+/* Asks fontconfig for a font with the glyph and appends it to the chain.
+ * Both outcomes are kept in the font cache for the next run. */
+static Fnt *
+fallback_load(Drw *drw, long codepoint)
 {
-	char buf[1024];
-	int ty;
-	unsigned int ew;
-	XftDraw *d = NULL;
-	Fnt *usedfont, *curfont, *nextfont;
-	size_t i, len;
-	int utf8strlen, utf8charlen, render = x || y || w || h;
-	long utf8codepoint = 0;
-	const char *utf8str;
 	FcCharSet *fccharset;
 	FcPattern *fcpattern;
 	FcPattern *match;
-	XftResult result;
-	int charexists = 0;
+	Fnt *font = NULL, *curfont;
+	const char *cached;
+	char key[16];
+
+	if (!drw->fonts->pattern) {
+		/* Refer to the comment in xfont_create for more information. */
+		die("the first font in the cache must be loaded from a font string.");
+	}
+
+	snprintf(key, sizeof(key), "%lx", codepoint);
+	if ((cached = fontcache_get("glyph", key))) {
+		if (!strcmp(cached, "-"))
+			return NULL;
+		if ((match = FcNameParse((FcChar8 *)cached))) {
+			font = xfont_create(drw, NULL, match);
+			if (font && font_has(drw, font, codepoint))
+				goto found;
+			xfont_free(font);
+			font = NULL;
+		}
+	}
+
+	drw->glyphstats.fc_calls++;
+	fccharset = FcCharSetCreate();
+	FcCharSetAddChar(fccharset, codepoint);
+
+	fcpattern = FcPatternDuplicate(drw->fonts->pattern);
+	FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
+	FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
+	FcPatternAddBool(fcpattern, FC_COLOR, FcFalse);
+
+	FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
+	FcDefaultSubstitute(fcpattern);
+	match = font_match(drw, fcpattern);
+
+	FcCharSetDestroy(fccharset);
+	FcPatternDestroy(fcpattern);
+
+	if (match)
+		font = xfont_create(drw, NULL, match);
+	if (!font || !font_has(drw, font, codepoint)) {
+		xfont_free(font);
+		cache_pattern("glyph", key, NULL);
+		return NULL;
+	}
+	cache_pattern("glyph", key, font_pattern(font));
+
+found:
+	for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
+		; /* NOP */
+	curfont->next = font;
+	drw->nfonts++;
+	drw->nfallback++;
+	return font;
+}
+
+/* Returns the first font of the chain that has the glyph, loading a fallback
+ * font if none does, or NULL if there is no such font. Both outcomes are
+ * remembered, so fontconfig is asked at most once per codepoint. */
+static Fnt *
+font_for(Drw *drw, long codepoint)
+{
+	GlyphFont *g = drw->glyphs_cap ? glyph_slot(drw, codepoint) : NULL;
+	Fnt *font;
+	unsigned int i;
+
+	if (g && g->used && (g->font || g->nfonts == drw->nfonts)) {
+		drw->glyphstats.hits++;
+		return g->font;
+	}
+	drw->glyphstats.misses++;
+
+	/* a miss only has to be checked against fonts appended since */
+	i = g && g->used ? g->nfonts : 0;
+	for (font = drw->fonts; font && i; font = font->next, i--)
+		; /* NOP */
+	for (; font; font = font->next)
+		if (font_has(drw, font, codepoint))
+			break;
+	if (!font && !(g && g->used) && drw->nfallback < FALLBACK_MAX)
+		font = fallback_load(drw, codepoint);
+
+	if (!g || !g->used)
+		g = glyph_insert(drw, codepoint);
+	g->font = font;
+	g->nfonts = drw->nfonts;
+	return font;
+}
+
+/* Truncates a run to w and appends it to the layout. */
+static void
+layout_add(TextLayout *l, Fnt *font, const char *str, size_t len, unsigned int *w)
+{
+	TextRun *run;
+	unsigned int ew = 0, tw;
+	size_t i, lo, hi, mid, full = len;
+
+	drw_font_getexts(font, str, len, &ew, NULL);
+	/* shorten text if necessary, the extents of a prefix grow with its
+	 * length so the longest one that fits is found by bisection */
+	if (ew > *w) {
+		for (lo = 0, hi = len - 1; lo < hi; ) {
+			mid = (lo + hi + 1) / 2;
+			drw_font_getexts(font, str, mid, &tw, NULL);
+			if (tw > *w)
+				hi = mid - 1;
+			else
+				lo = mid;
+		}
+		/* never end on half a character */
+		for (len = lo; len && (str[len] & 0xC0) == 0x80; len--)
+			; /* NOP */
+		drw_font_getexts(font, str, len, &ew, NULL);
+	}
+	if (!len)
+		return;
+
+	if (!(l->runs = realloc(l->runs, (l->nruns + 1) * sizeof(TextRun))))
+		die("realloc:");
+	run = &l->runs[l->nruns++];
+	run->font = font;
+	run->off = l->outlen;
+	run->len = len;
+	run->w = ew;
+	memcpy(l->out + l->outlen, str, len);
+	if (len < full)
+		for (i = len; i && i > len - 3; l->out[l->outlen + --i] = '.')
+			; /* NOP */
+	l->outlen += len;
+	l->ew += ew;
+	*w -= ew;
+}
+
+/* Splits text into runs of one font each and truncates them to w, exactly as
+ * drawing it would. A cached layout is drawn without any font lookups. */
+static TextLayout *
+layout_create(Drw *drw, const char *text, unsigned int w)
+{
+	TextLayout *l;
+	Fnt *usedfont = NULL, *font;
+	const char *run = text;
+	long utf8codepoint = 0;
+	size_t len;
+
+	l = ecalloc(1, sizeof(TextLayout));
+	len = strlen(text);
+	l->text = ecalloc(len + 1, 1);
+	memcpy(l->text, text, len);
+	l->out = ecalloc(len + 1, 1);
+	l->w = w;
+	l->fonts = drw->fonts;
+
+	while (*text) {
+		len = utf8decode(text, &utf8codepoint, UTF_SIZ);
+		/* without any font for it the glyph is drawn as a box */
+		if (!(font = font_for(drw, utf8codepoint)))
+			font = drw->fonts;
+		if (font != usedfont) {
+			if (usedfont)
+				layout_add(l, usedfont, run, text - run, &w);
+			usedfont = font;
+			run = text;
+		}
+		text += len;
+	}
+	if (usedfont)
+		layout_add(l, usedfont, run, text - run, &w);
+	return l;
+}
+
+static void
+layout_free(TextLayout *l)
+{
+	free(l->text);
+	free(l->out);
+	free(l->runs);
+	free(l);
+}
+
+static unsigned int
+layout_hash(const char *text, unsigned int w)
+{
+	unsigned int h = 5381;
+
+	while (*text)
+		h = h * 33 + (unsigned char)*text++;
+	return (h ^ w * 2654435761u) % LAYOUT_BUCKETS;
+}
+
+static TextLayout *
+layout_get(Drw *drw, const char *text, unsigned int w)
+{
+	TextLayout *l, **bucket = &drw->layouts[layout_hash(text, w)];
+
+	for (l = *bucket; l; l = l->next)
+		if (l->w == w && l->fonts == drw->fonts && !strcmp(l->text, text))
+			return l;
+
+	/* labels hardly change, a cache this full means something churns */
+	if (drw->nlayouts >= 256)
+		drw_text_invalidate(drw, NULL);
+	l = layout_create(drw, text, w);
+	l->next = *bucket;
+	*bucket = l;
+	drw->nlayouts++;
+	return l;
+}
+
+/* Drops the cached layouts of text, or all of them if text is NULL. */
+void
+drw_text_invalidate(Drw *drw, const char *text)
+{
+	TextLayout **p, *l;
+	size_t i;
+
+	if (!drw)
+		return;
+
+	for (i = 0; i < LAYOUT_BUCKETS; i++) {
+		for (p = &drw->layouts[i]; (l = *p); ) {
+			if (!text || !strcmp(l->text, text)) {
+				*p = l->next;
+				layout_free(l);
+				drw->nlayouts--;
+			} else {
+				p = &l->next;
+			}
+		}
+	}
+}
+
+int
+drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert)
+{
+	int ty, i, render = x || y || w || h;
+	XftDraw *d = NULL;
+	TextLayout *l;
+	TextRun *run;
 
 	if (!drw || (render && !drw->scheme) || !text || !drw->fonts)
 		return 0;
 
 	if (!render) {
 		w = ~w;
+	} else if (!drw->dpy) {
+		soft_fill(soft_buf(drw, drw->drawable), x, y, w, h, drw->scheme[invert ? ColFg : ColBg].pixel);
+		x += lpad;
+		w -= lpad;
 	} else {
 		XSetForeground(drw->dpy, drw->gc, drw->scheme[invert ? ColFg : ColBg].pixel);
 		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-		d = XftDrawCreate(drw->dpy, drw->drawable,
-		                  DefaultVisual(drw->dpy, drw->screen),
-		                  DefaultColormap(drw->dpy, drw->screen));
 		x += lpad;
 		w -= lpad;
 	}
 
-	usedfont = drw->fonts;
-	while (1) {
-		utf8strlen = 0;
-		utf8str = text;
-		nextfont = NULL;
-		while (*text) {
-			utf8charlen = utf8decode(text, &utf8codepoint, UTF_SIZ);
-			for (curfont = drw->fonts; curfont; curfont = curfont->next) {
-				charexists = charexists || XftCharExists(drw->dpy, curfont->xfont, utf8codepoint);
-				if (charexists) {
-					if (curfont == usedfont) {
-						utf8strlen += utf8charlen;
-						text += utf8charlen;
-					} else {
-						nextfont = curfont;
-					}
-					break;
-				}
-			}
-
-			if (!charexists || nextfont)
-				break;
+	l = layout_get(drw, text, w);
+	if (render && l->nruns) {
+		if (drw->dpy)
+			d = XftDrawCreate(drw->dpy, drw->drawable,
+			                  DefaultVisual(drw->dpy, drw->screen),
+			                  DefaultColormap(drw->dpy, drw->screen));
+		for (i = 0; i < l->nruns; i++) {
+			run = &l->runs[i];
+			ty = y + (h - run->font->h) / 2 + run->font->ascent;
+			if (d)
+				XftDrawStringUtf8(d, &drw->scheme[invert ? ColBg : ColFg],
+				                  run->font->xfont, x, ty, (XftChar8 *)l->out + run->off, run->len);
 			else
-				charexists = 0;
+				soft_text(soft_buf(drw, drw->drawable), run->font, x, ty, l->out + run->off,
+				          run->len, drw->scheme[invert ? ColBg : ColFg].pixel);
+			x += run->w;
 		}
+		if (d)
+			XftDrawDestroy(d);
+	} else {
+		x += l->ew;
+	}
+	w -= l->ew;
 
-		if (utf8strlen) {
-			drw_font_getexts(usedfont, utf8str, utf8strlen, &ew, NULL);
-			/* shorten text if necessary */
-			for (len = MIN(utf8strlen, sizeof(buf) - 1); len && ew > w; len--)
-				drw_font_getexts(usedfont, utf8str, len, &ew, NULL);
-
-			if (len) {
-				memcpy(buf, utf8str, len);
-				buf[len] = '\0';
-				if (len < utf8strlen)
-					for (i = len; i && i > len - 3; buf[--i] = '.')
-						; /* NOP */
-
-				if (render) {
-					ty = y + (h - usedfont->h) / 2 + usedfont->xfont->ascent;
-					XftDrawStringUtf8(d, &drw->scheme[invert ? ColBg : ColFg],
-					                  usedfont->xfont, x, ty, (XftChar8 *)buf, len);
-				}
-				x += ew;
-				w -= ew;
-			}
-		}
+	return x + (render ? w : 0);
+}
 
-		if (!*text) {
-			break;
-		} else if (nextfont) {
-			charexists = 0;
-			usedfont = nextfont;
-		} else {
-			/* Regardless of whether or not a fallback font is found, the
-			 * character must be drawn. */
-			charexists = 1;
+void
+drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h)
+{
+	XRectangle r = { x, y, w, h };
 
-			fccharset = FcCharSetCreate();
-			FcCharSetAddChar(fccharset, utf8codepoint);
+	drw_map_rects(drw, win, &r, 1);
+}
 
-			if (!drw->fonts->pattern) {
-				/* Refer to the comment in xfont_create for more information. */
-				die("the first font in the cache must be loaded from a font string.");
-			}
+#ifdef PRESENT
+/* Queues the pixmap with the Present extension and only flushes, the server
+ * copies it at the next vblank. Until the complete event arrives, see
+ * drw_present_event(), the pixmap must not be drawn to. */
+static void
+present_rects(Drw *drw, Window win, const XRectangle *rects, int n)
+{
+	XserverRegion update;
 
-			fcpattern = FcPatternDuplicate(drw->fonts->pattern);
-			FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
-			FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
-			FcPatternAddBool(fcpattern, FC_COLOR, FcFalse);
-
-			FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
-			FcDefaultSubstitute(fcpattern);
-			match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
-
-			FcCharSetDestroy(fccharset);
-			FcPatternDestroy(fcpattern);
-
-			if (match) {
-				usedfont = xfont_create(drw, NULL, match);
-				if (usedfont && XftCharExists(drw->dpy, usedfont->xfont, utf8codepoint)) {
-					for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
-						; /* NOP */
-					curfont->next = usedfont;
-				} else {
-					xfont_free(usedfont);
-					usedfont = drw->fonts;
-				}
-			}
-		}
+	if (drw->present_win != win) {
+		XPresentSelectInput(drw->dpy, win, PresentCompleteNotifyMask);
+		drw->present_win = win;
 	}
-	if (d)
-		XftDrawDestroy(d);
+	update = XFixesCreateRegion(drw->dpy, (XRectangle *)rects, n);
+	XPresentPixmap(drw->dpy, win, drw->drawable, ++drw->present_serial, None, update,
+	               0, 0, None, None, None, PresentOptionNone, 0, 0, 0, NULL, 0);
+	XFixesDestroyRegion(drw->dpy, update);
+	XFlush(drw->dpy);
+	drw->presenting++;
+}
+#endif
 
-	return x + (render ? w : 0);
+#ifdef XCB
+/* Like the Xlib version, but the server is waited for one frame later: the
+ * copy of the last frame has usually finished by now, so the frame just sent
+ * does not cost a round trip. */
+static void
+copy_rects(Drw *drw, Window win, const XRectangle *rects, int n)
+{
+	xcb_connection_t *c = XGetXCBConnection(drw->dpy);
+	xcb_gcontext_t gc = XGContextFromGC(drw->gc);
+	void *reply;
+	int i;
+
+	if (drw->syncing) {
+		if (!xcb_poll_for_reply(c, drw->sync, &reply, NULL))
+			reply = xcb_get_input_focus_reply(c, (xcb_get_input_focus_cookie_t) { drw->sync }, NULL);
+		free(reply);
+	}
+	for (i = 0; i < n; i++)
+		xcb_copy_area(c, drw->drawable, win, gc, rects[i].x, rects[i].y,
+		              rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+	drw->sync = xcb_get_input_focus(c).sequence;
+	drw->syncing = 1;
+	xcb_flush(c);
+}
+#else
+/* waits until the server copied them */
+static void
+copy_rects(Drw *drw, Window win, const XRectangle *rects, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		XCopyArea(drw->dpy, drw->drawable, win, drw->gc, rects[i].x, rects[i].y,
+		          rects[i].width, rects[i].height, rects[i].x, rects[i].y);
+	XSync(drw->dpy, False);
 }
+#endif
 
+/* copies only the given regions */
 void
-drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h)
+drw_map_rects(Drw *drw, Window win, const XRectangle *rects, int n)
 {
-	if (!drw)
+	/* the buffer of the software renderer is the output */
+	if (!drw || !drw->dpy)
 		return;
 
-	XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, x, y);
-	XSync(drw->dpy, False);
+#ifdef PRESENT
+	if (drw->present) {
+		present_rects(drw, win, rects, n);
+		return;
+	}
+#endif
+	copy_rects(drw, win, rects, n);
+}
+
+/* true while a presented frame still reads from the pixmap */
+int
+drw_busy(Drw *drw)
+{
+	return drw && drw->presenting > 0;
+}
+
+/* Consumes the Present events of drw, returns 0 for every other event. */
+int
+drw_present_event(Drw *drw, XEvent *ev)
+{
+#ifdef PRESENT
+	XGenericEventCookie *cookie = &ev->xcookie;
+
+	if (!drw || !drw->present || ev->type != GenericEvent || cookie->extension != drw->present_opcode)
+		return 0;
+	if (XGetEventData(drw->dpy, cookie)) {
+		if (cookie->evtype == PresentCompleteNotify && drw->presenting > 0)
+			drw->presenting--;
+		XFreeEventData(drw->dpy, cookie);
+	}
+	return 1;
+#else
+	return 0;
+#endif
 }
 
 unsigned int
@@ -405,7 +1130,10 @@ drw_font_getexts(Fnt *font, const char *text, unsigned int len, unsigned int *w,
 	if (!font || !text)
 		return;
 
-	XftTextExtentsUtf8(font->dpy, font->xfont, (XftChar8 *)text, len, &ext);
+	if (!font->xfont)
+		ext.xOff = soft_extents(font, text, len);
+	else
+		XftTextExtentsUtf8(font->dpy, font->xfont, (XftChar8 *)text, len, &ext);
 	if (w)
 		*w = ext.xOff;
 	if (h)
@@ -420,7 +1148,8 @@ drw_cur_create(Drw *drw, int shape)
 	if (!drw || !(cur = ecalloc(1, sizeof(Cur))))
 		return NULL;
 
-	cur->cursor = XCreateFontCursor(drw->dpy, shape);
+	if (drw->dpy)
+		cur->cursor = XCreateFontCursor(drw->dpy, shape);
 
 	return cur;
 }
@@ -431,6 +1160,7 @@ drw_cur_free(Drw *drw, Cur *cursor)
 	if (!cursor)
 		return;
 
-	XFreeCursor(drw->dpy, cursor->cursor);
+	if (drw->dpy)
+		XFreeCursor(drw->dpy, cursor->cursor);
 	free(cursor);
 }
@@ -4,32 +4,110 @@ typedef struct {
 	Cursor cursor;
 } Cur;
 
+#define SOFT_GLYPH_BUCKETS 128
+
+/* Rendered glyph of the software renderer, 8 bit coverage */
+typedef struct SoftGlyph {
+	long codepoint;
+	int left, top, advance;
+	unsigned int w, h;
+	unsigned char *bitmap;
+	struct SoftGlyph *next;
+} SoftGlyph;
+
 typedef struct Fnt {
 	Display *dpy;
 	unsigned int h;
+	int ascent;
 	XftFont *xfont;
 	FcPattern *pattern;
+	/* software renderer, instead of xfont */
+	FT_Face face;
+	FcPattern *match;
+	SoftGlyph *glyphs[SOFT_GLYPH_BUCKETS];
 	struct Fnt *next;
 } Fnt;
 
 enum { ColFg, ColBg }; /* Clr scheme index */
 typedef XftColor Clr;
 
+#define LAYOUT_BUCKETS 64
+
+/* One font run of a laid out text */
+typedef struct {
+	Fnt *font;
+	size_t off, len;  /* bytes of TextLayout.out */
+	unsigned int w;
+} TextRun;
+
+/* Font runs and truncation of a text in a given width, see drw_text() */
+typedef struct TextLayout {
+	char *text;       /* key, with w and fonts */
+	unsigned int w;
+	Fnt *fonts;
+	char *out;        /* truncated text of all runs */
+	TextRun *runs;
+	int nruns;
+	size_t outlen;
+	unsigned int ew;  /* width of all runs */
+	struct TextLayout *next;
+} TextLayout;
+
+/* Resolved font of a codepoint, font is NULL if none of the first nfonts
+ * fonts of the chain has it */
+typedef struct {
+	long codepoint;
+	Fnt *font;
+	unsigned int nfonts;
+	char used;
+} GlyphFont;
+
+typedef struct {
+	unsigned long hits, misses;  /* font_for() lookups */
+	unsigned long fc_calls;      /* fontconfig fallback matches */
+} GlyphStats;
+
+/* In memory drawable of the software renderer, px is NULL in a free slot */
 typedef struct {
 	unsigned int w, h;
-	Display *dpy;
+	uint32_t *px;  /* ARGB */
+} SoftBuf;
+
+typedef struct {
+	unsigned int w, h;
+	Display *dpy;    /* NULL for the software renderer, see drw_create() */
 	int screen;
 	Window root;
 	Drawable drawable;
 	GC gc;
 	Clr *scheme;
 	Fnt *fonts;
+	int present, present_opcode;  /* Present extension, only with -DPRESENT */
+	Window present_win;
+	unsigned int present_serial;
+	int presenting;
+	unsigned int sync;  /* sequence of the last copy's sync, only with -DXCB */
+	int syncing;
+	TextLayout *layouts[LAYOUT_BUCKETS];
+	unsigned int nlayouts;
+	GlyphFont *glyphs;
+	unsigned int nglyphs, glyphs_cap;
+	unsigned int nfonts, nfallback;
+	GlyphStats glyphstats;
+	FT_Library ft;   /* software renderer, drawables index bufs from 1 */
+	SoftBuf *bufs;
+	unsigned int nbufs;
 } Drw;
 
 /* Drawable abstraction */
 Drw *drw_create(Display *dpy, int screen, Window win, unsigned int w, unsigned int h);
 void drw_resize(Drw *drw, unsigned int w, unsigned int h);
 void drw_free(Drw *drw);
+Pixmap drw_pixmap_create(Drw *drw, unsigned int w, unsigned int h);
+void drw_pixmap_free(Drw *drw, Pixmap pixmap);
+Drawable drw_settarget(Drw *drw, Drawable d);
+void drw_copy(Drw *drw, Drawable src, int sx, int sy, unsigned int w, unsigned int h, int dx, int dy);
+const uint32_t *drw_pixels(Drw *drw, unsigned int *w, unsigned int *h);
 
 /* Fnt abstraction */
 Fnt *drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount);
@@ -52,6 +130,10 @@ void drw_setscheme(Drw *drw, Clr *scm);
 /* Drawing functions */
 void drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int invert);
 int drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert);
+void drw_text_invalidate(Drw *drw, const char *text);
 
 /* Map functions */
 void drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h);
+void drw_map_rects(Drw *drw, Window win, const XRectangle *rects, int n);
+int drw_busy(Drw *drw);
+int drw_present_event(Drw *drw, XEvent *ev);
@@ -0,0 +1,90 @@
+/* See LICENSE file for copyright and license details. */
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "util.h"
+
+/* Measures the exec-to-exit time of whole command lines, e.g.
+ *
+ *   execbench -n 500 './daudioctl inc' './daudio -cmd inc'
+ *
+ * prints one line per command: command, runs, min, median and mean in µs. */
+
+extern char **environ;
+
+static int
+cmpdouble(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double
+run(char *argv[], int *failed)
+{
+	struct timespec start, end, diff;
+	pid_t pid;
+	int status;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ) != 0)
+		die("execbench: cannot spawn %s", argv[0]);
+	if (waitpid(pid, &status, 0) < 0)
+		die("waitpid:");
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		(*failed)++;
+	timespec_diff(&diff, &end, &start);
+	return diff.tv_sec * 1e6 + diff.tv_nsec / 1e3;
+}
+
+static void
+bench(const char *cmd, int runs)
+{
+	char line[256], *argv[16], *tok;
+	double *t, sum = 0;
+	int i, argc = 0, failed = 0;
+
+	strlcpy(line, cmd, sizeof(line));
+	for (tok = strtok(line, " "); tok && argc < 15; tok = strtok(NULL, " "))
+		argv[argc++] = tok;
+	argv[argc] = NULL;
+	if (!argc)
+		return;
+
+	t = ecalloc(runs, sizeof(*t));
+	run(argv, &failed); /* warm up the page cache */
+	failed = 0;
+	for (i = 0; i < runs; i++)
+		sum += (t[i] = run(argv, &failed));
+	if (failed)
+		fprintf(stderr, "execbench: '%s' failed in %d of %d runs\n", cmd, failed, runs);
+	qsort(t, runs, sizeof(*t), cmpdouble);
+	printf("%s\t%d\t%.1f\t%.1f\t%.1f\n", cmd, runs, t[0], t[runs / 2], sum / runs);
+	free(t);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int i = 1, runs = 100;
+
+	if (argc > 2 && !strcmp(argv[1], "-n")) {
+		runs = MAX(1, atoi(argv[2]));
+		i = 3;
+	}
+	if (i == argc) {
+		fputs("usage: execbench [-n runs] command...\n", stderr);
+		exit(1);
+	}
+	printf("# command\truns\tmin_us\tmedian_us\tmean_us\n");
+	for (; i < argc; i++)
+		bench(argv[i], runs);
+	return 0;
+}
@@ -0,0 +1,186 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fontconfig/fontconfig.h>
+
+#include "fontcache.h"
+#include "util.h"
+
+#define MAGIC "daudio-fontcache 1"
+
+typedef struct {
+	char *key;   /* "<kind>:<key>" */
+	char *value;
+} Entry;
+
+static char *path;
+static char stamp[64];
+static Entry *entries;
+static size_t nentries, cap;
+static int dirty;
+
+static char *
+xstrdup(const char *s)
+{
+	size_t n = strlen(s) + 1;
+
+	return memcpy(ecalloc(n, 1), s, n);
+}
+
+/* The newest mtime of the configuration files and font directories, plus
+ * their number to notice removals. */
+static void
+fc_stamp(char *dst, size_t size)
+{
+	FcConfig *config = FcConfigGetCurrent();
+	FcStrList *list;
+	FcChar8 *file;
+	struct stat st;
+	long long latest = 0, n = 0;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		list = i ? FcConfigGetFontDirs(config) : FcConfigGetConfigFiles(config);
+		if (!list)
+			continue;
+		while ((file = FcStrListNext(list))) {
+			if (!stat((char *)file, &st) && st.st_mtime > latest)
+				latest = st.st_mtime;
+			n++;
+		}
+		FcStrListDone(list);
+	}
+	snprintf(dst, size, "%lld-%lld", latest, n);
+}
+
+static Entry *
+find(const char *kind, const char *key)
+{
+	size_t i, klen = strlen(kind);
+
+	for (i = 0; i < nentries; i++)
+		if (!strncmp(entries[i].key, kind, klen) && entries[i].key[klen] == ':'
+		    && !strcmp(entries[i].key + klen + 1, key))
+			return &entries[i];
+	return NULL;
+}
+
+static void
+add(char *key, char *value)
+{
+	if (nentries == cap) {
+		cap = cap ? cap * 2 : 16;
+		if (!(entries = realloc(entries, cap * sizeof(Entry))))
+			die("realloc:");
+	}
+	entries[nentries].key = key;
+	entries[nentries].value = value;
+	nentries++;
+}
+
+void
+fontcache_open(const char *file)
+{
+	FILE *fp;
+	char *line = NULL, *tab, header[sizeof(MAGIC) + sizeof(stamp) + 1];
+	size_t len = 0;
+	ssize_t n;
+
+	path = xstrdup(file);
+	fc_stamp(stamp, sizeof(stamp));
+	if (!(fp = fopen(path, "r")))
+		return;
+
+	snprintf(header, sizeof(header), "%s %s\n", MAGIC, stamp);
+	if ((n = getline(&line, &len, fp)) < 0 || strcmp(line, header)) {
+		/* stale or foreign, rewritten on the next save */
+		dirty = 1;
+	} else {
+		while ((n = getline(&line, &len, fp)) > 0) {
+			if (line[n - 1] == '\n')
+				line[--n] = '\0';
+			if (!(tab = strchr(line, '\t')))
+				continue;
+			*tab = '\0';
+			add(xstrdup(line), xstrdup(tab + 1));
+		}
+	}
+	free(line);
+	fclose(fp);
+}
+
+const char *
+fontcache_get(const char *kind, const char *key)
+{
+	Entry *e;
+
+	if (!path || !(e = find(kind, key)))
+		return NULL;
+	return e->value;
+}
+
+void
+fontcache_put(const char *kind, const char *key, const char *value)
+{
+	Entry *e;
+	char *k;
+
+	if (!path)
+		return;
+	if ((e = find(kind, key))) {
+		if (!strcmp(e->value, value))
+			return;
+		free(e->value);
+		e->value = xstrdup(value);
+	} else {
+		k = ecalloc(strlen(kind) + strlen(key) + 2, 1);
+		sprintf(k, "%s:%s", kind, key);
+		add(k, xstrdup(value));
+	}
+	dirty = 1;
+}
+
+/* Writes a temporary file and renames it, readers never see half a cache. */
+void
+fontcache_save(void)
+{
+	FILE *fp;
+	char *tmp;
+	size_t i;
+
+	if (!path || !dirty)
+		return;
+	tmp = ecalloc(strlen(path) + 5, 1);
+	sprintf(tmp, "%s.tmp", path);
+	if (!(fp = fopen(tmp, "w"))) {
+		free(tmp);
+		return;
+	}
+	fprintf(fp, "%s %s\n", MAGIC, stamp);
+	for (i = 0; i < nentries; i++)
+		fprintf(fp, "%s\t%s\n", entries[i].key, entries[i].value);
+	if (fclose(fp) || rename(tmp, path))
+		unlink(tmp);
+	else
+		dirty = 0;
+	free(tmp);
+}
+
+void
+fontcache_free(void)
+{
+	size_t i;
+
+	for (i = 0; i < nentries; i++) {
+		free(entries[i].key);
+		free(entries[i].value);
+	}
+	free(entries);
+	free(path);
+	entries = NULL;
+	path = NULL;
+	nentries = cap = 0;
+}
@@ -0,0 +1,14 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Resolved fontconfig patterns kept on disk between runs, so fonts can be
+ * opened without matching. Entries are looked up by kind ("font" for a
+ * configured font name, "glyph" for a fallback codepoint) and key, the value
+ * is an unparsed pattern or "-" if nothing matched. Everything is discarded
+ * when the fontconfig configuration or a font directory changed. All calls
+ * are no-ops until fontcache_open(). */
+
+void fontcache_open(const char *path);
+const char *fontcache_get(const char *kind, const char *key);
+void fontcache_put(const char *kind, const char *key, const char *value);
+void fontcache_save(void);
+void fontcache_free(void);
@@ -0,0 +1,59 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Shared by daudio-bench and daudio-stress. daudio.c is included for its
+ * static functions, its main() under another name, since they bring their
+ * own. The fixture below sets up what setup() would without X: the drawing
+ * context, fonts and colors. Frames go to the software renderer. */
+
+#define main daudio_main
+#include "daudio.c"
+#undef main
+
+static void
+headless_setup(void)
+{
+	if (!(drw = drw_create(NULL, 0, 0, width, height)))
+		die("cannot create drawing context");
+	if (!drw_fontset_create(drw, fonts, LENGTH(fonts)))
+		die("no fonts could be loaded.");
+	for (int i = 0; i < SchemeLast; i++)
+		scheme[i] = drw_scm_create(drw, colors[i], 2);
+	drw_setscheme(drw, scheme[SchemeNorm]);
+	bh = (int) drw->fonts->h + 2;
+	lrpad = (int) drw->fonts->h;
+	mw = width;
+	mh = 0;
+	interactive = 1;
+	if ((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0)
+		die("timerfd_create:");
+}
+
+/* cleanup() leaves the drawing context to the display, there is none here */
+static void
+headless_cleanup(void)
+{
+	for (int i = 0; i < nrow_pixmaps; i++) {
+		drw_pixmap_free(drw, row_pixmaps[i].pix[0]);
+		drw_pixmap_free(drw, row_pixmaps[i].pix[1]);
+	}
+	drw_free(drw);
+	cleanup();
+}
+
+/* One repeat of a held volume key, steps at a time. It turns around at the
+ * top and at mute, so the limits are not all that is measured. Call with the
+ * backend locked. */
+static void
+hold_volume_key(int steps)
+{
+	static int direction = 1;
+	const PulseSink *sink = get_default_sink();
+
+	if (!sink)
+		return;
+	if (sink->volume >= roundf(max_volume_factor * PA_VOLUME_NORM))
+		direction = -1;
+	else if (sink->mute)
+		direction = 1;
+	change_volume(direction * steps);
+}
@@ -0,0 +1,303 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "pulseaudio.h"
+#include "mock.h"
+#include "sinks.h"
+
+/* acknowledgements of our own operations, queued behind the events */
+enum { AckVolume = MockDefault + 1, AckMute, AckDefault };
+
+typedef struct {
+    struct timespec due;
+    int type;
+    uint32_t index;
+    uint32_t value;
+} MockOp;
+
+static int initial_sinks = 4;
+static int latency = 0;
+
+/* recursive like the pa_threaded_mainloop lock it stands in for */
+static pthread_mutex_t lock;
+static pthread_cond_t queue_cond, ops_cond;
+static pthread_t thread;
+static int running = 0;
+
+static MockOp *queue = NULL;
+static int queue_head = 0, queue_count = 0, queue_cap = 0;
+
+static SinkHandle default_sink = 0;
+static int ops_in_flight = 0;
+static int wake_fd = -1;
+static PulseStats stats;
+
+void mock_configure(int sinks, int latency_ms) {
+    initial_sinks = sinks;
+    latency = latency_ms;
+}
+
+static void add_sink(uint32_t index) {
+    SinkHandle h = sinks_add(index);
+    PulseSink *sink = sinks_get(h);
+    char name[sizeof(sink->name)];
+
+    snprintf(name, sizeof(name), "mock.%u", index);
+    sinks_set_name(h, name);
+    snprintf(sink->description, sizeof(sink->description), "Mock sink %u", index);
+    sink->volume = PA_VOLUME_NORM / 100 * (20 + index * 7 % 80);
+    sink->base_volume = PA_VOLUME_NORM;
+    sink->channels = 2;
+    sink->mute = index % 5 == 4;
+    if (!default_sink) {
+        default_sink = h;
+    }
+}
+
+static void push(int type, uint32_t index, uint32_t value) {
+    MockOp *op;
+
+    if (queue_head + queue_count == queue_cap) {
+        if (queue_head > 0) {
+            memmove(queue, queue + queue_head, sizeof(*queue) * queue_count);
+            queue_head = 0;
+        } else {
+            queue_cap = queue_cap ? queue_cap * 2 : 16;
+            if (!(queue = realloc(queue, sizeof(*queue) * queue_cap))) {
+                die("realloc:");
+            }
+        }
+    }
+    op = &queue[queue_head + queue_count++];
+    clock_gettime(CLOCK_MONOTONIC, &op->due);
+    timespecAddMs(&op->due, latency);
+    op->type = type;
+    op->index = index;
+    op->value = value;
+    pthread_cond_signal(&queue_cond);
+}
+
+static void apply(const MockOp *op) {
+    SinkHandle h = sinks_find(op->index);
+    PulseSink *sink = sinks_get(h);
+
+    if (op->type <= MockDefault) {
+        stats.events++;
+    }
+    switch (op->type) {
+        case MockAdd:
+            add_sink(op->index);
+            break;
+        case MockRemove:
+            sinks_remove(h);
+            if (h == default_sink) {
+                default_sink = sinks_count() ? sinks_at(0)->handle : 0;
+            }
+            break;
+        case MockVolume:
+            if (sink) {
+                sink->volume = op->value;
+            }
+            break;
+        case MockMute:
+            if (sink) {
+                sink->mute = op->value;
+            }
+            break;
+        case AckDefault:
+            ops_in_flight--;
+            /* fall through */
+        case MockDefault:
+            if (sink) {
+                default_sink = h;
+            }
+            break;
+        case AckVolume:
+        case AckMute:
+            ops_in_flight--;
+            break;
+    }
+    if (ops_in_flight == 0) {
+        pthread_cond_broadcast(&ops_cond);
+    }
+}
+
+/* The server: answers everything that is due, then publishes once. */
+static void *run(void *arg) {
+    struct timespec now, due;
+    uint64_t one = 1;
+    int applied;
+
+    pthread_mutex_lock(&lock);
+    while (running) {
+        if (!queue_count) {
+            pthread_cond_wait(&queue_cond, &lock);
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (applied = 0; queue_count && timespecGte(&now, &queue[queue_head].due); applied++) {
+            apply(&queue[queue_head++]);
+            queue_count--;
+        }
+        if (applied) {
+            sinks_publish(default_sink);
+            /* a full counter already wakes the ui thread */
+            if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+                die("write wake fd:");
+            }
+        } else {
+            due = queue[queue_head].due;
+            pthread_cond_timedwait(&queue_cond, &lock, &due);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+static int mock_setup(int fetch_delay_ms) {
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+
+    if (running)
+        return -1;
+    if ((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        die("eventfd:");
+    }
+
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&lock, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue_cond, &cattr);
+    pthread_cond_init(&ops_cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    /* the initial list is there right away, there is no connection to wait for */
+    for (int i = 0; i < initial_sinks; i++) {
+        add_sink(i);
+    }
+    sinks_publish(default_sink);
+
+    running = 1;
+    if (pthread_create(&thread, NULL, run, NULL)) {
+        die("pthread_create:");
+    }
+    return 0;
+}
+
+static int mock_free(void) {
+    if (!running)
+        return -1;
+    pthread_mutex_lock(&lock);
+    running = 0;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+    pthread_cond_destroy(&ops_cond);
+    pthread_cond_destroy(&queue_cond);
+    pthread_mutex_destroy(&lock);
+
+    if (wake_fd >= 0)
+        close(wake_fd);
+    sinks_free();
+    free(queue);
+    queue = NULL;
+    queue_head = queue_count = queue_cap = 0;
+    default_sink = 0;
+    ops_in_flight = 0;
+    return 0;
+}
+
+void mock_inject(const MockEvent *ev) {
+    pthread_mutex_lock(&lock);
+    push(ev->type, ev->index, ev->value);
+    pthread_mutex_unlock(&lock);
+}
+
+/* Like the pulse backend the local value changes right away and the
+ * acknowledgement comes later. */
+static void mock_set_volume(const PulseSink *target, pa_volume_t volume) {
+    PulseSink *sink = sinks_get(target->handle);
+
+    if (!sink) {
+        return;
+    }
+    sink->volume = volume;
+    ops_in_flight++;
+    push(AckVolume, sink->index, volume);
+    sinks_publish(default_sink);
+}
+
+static void mock_set_mute(const PulseSink *target, uint8_t mute) {
+    PulseSink *sink = sinks_get(target->handle);
+
+    if (!sink) {
+        return;
+    }
+    sink->mute = mute;
+    ops_in_flight++;
+    push(AckMute, sink->index, mute);
+    sinks_publish(default_sink);
+}
+
+static void mock_set_default_sink(const PulseSink *sink) {
+    ops_in_flight++;
+    push(AckDefault, sink->index, 0);
+}
+
+static int mock_wait_ready(int timeout_ms) {
+    return 0;
+}
+
+static int mock_wait_ops(void) {
+    while (ops_in_flight > 0) {
+        pthread_cond_wait(&ops_cond, &lock);
+    }
+    return 0;
+}
+
+static const PulseSink *mock_default_sink(void) {
+    return sinks_get(default_sink);
+}
+
+static void mock_lock(void) {
+    pthread_mutex_lock(&lock);
+}
+
+static void mock_unlock(void) {
+    pthread_mutex_unlock(&lock);
+}
+
+static const PulseStats *mock_stats(void) {
+    return &stats;
+}
+
+static int mock_fd(void) {
+    return wake_fd;
+}
+
+const AudioBackend mock_backend = {
+    .name = "mock",
+    .setup = mock_setup,
+    .free = mock_free,
+    .set_volume = mock_set_volume,
+    .set_mute = mock_set_mute,
+    .set_default_sink = mock_set_default_sink,
+    .wait_ready = mock_wait_ready,
+    .wait_ops = mock_wait_ops,
+    .default_sink = mock_default_sink,
+    .lock = mock_lock,
+    .unlock = mock_unlock,
+    .stats = mock_stats,
+    .fd = mock_fd,
+};
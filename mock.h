@@ -0,0 +1,20 @@
+/* See LICENSE file for copyright and license details. */
+
+/* In process audio backend, no sound server needed. It starts with a given
+ * number of sinks named mock.0, mock.1, ... and answers every operation and
+ * injected event latency ms after it was issued, in issue order, from its
+ * own thread. Sink properties follow from the sink number, so runs repeat. */
+
+enum { MockAdd, MockRemove, MockVolume, MockMute, MockDefault };
+
+typedef struct {
+    int type;
+    uint32_t index;  /* sink number */
+    uint32_t value;  /* volume for MockVolume, 0 or 1 for MockMute */
+} MockEvent;
+
+/* must be called before setup_pulse() */
+void mock_configure(int sinks, int latency_ms);
+/* a change made by somebody else on the server, may be called with
+ * pulse_lock() held */
+void mock_inject(const MockEvent *ev);
@@ -5,44 +5,228 @@
 #ifndef DAUDIO_PULSEAUDIO_C
 #define DAUDIO_PULSEAUDIO_C
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/eventfd.h>
 
 #include <pulse/pulseaudio.h>
 
 #include "pulseaudio.h"
+#include "sinks.h"
 
 static pa_context *context = NULL;
 static pa_threaded_mainloop *threaded_mainloop = NULL;
 static pa_mainloop_api *api = NULL;
 
-static PulseSink *sinks = NULL;
-static int sink_count = 0;
+static char default_sink_name[sizeof(((PulseSink *) 0)->name)];
+static SinkHandle default_sink = 0;
+
+static int wake_fd = -1;
+static pa_defer_event *publish_event = NULL;
+
+/* The initial state is complete once both the server info (default sink name)
+ * and the first sink list arrived. Waiters are released after it is published. */
+enum { ReadyServerInfo = 1, ReadySinkList = 2, ReadyAll = 3 };
+static int ready = 0;
+static int ready_published = 0;
+static pthread_mutex_t ready_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond;
+
+/* Operations sent to the server and not yet acknowledged, see wait_for_ops() */
+static int ops_in_flight = 0;
+static int ops_failed = 0;
+
+/* Sinks with a get_sink_info request scheduled or in flight. Events for a
+ * sink that is already in here are collapsed into that one request. */
+enum { FetchScheduled, FetchInFlight, FetchInFlightDirty, FetchRemoved };
+
+typedef struct {
+    uint32_t index;
+    int state;
+} PendingFetch;
+
+static PendingFetch *pending = NULL;
+static int pending_count = 0, pending_cap = 0;
+static pa_time_event *fetch_timer = NULL;
+static int fetch_timer_armed = 0;
+static pa_usec_t fetch_delay = 0;
+
+static PulseStats stats;
+
+/* A recording, see pulse_record(), is a header line and then records in host
+ * byte order. Each record is a type byte and the µs since the previous record
+ * as uint32, followed by
+ *   RecServerInfo   string default sink name
+ *   RecSinkInfo     sink, one of the initial sink list
+ *   RecSinkListEnd  nothing, the initial sink list is complete
+ *   RecSubscribe    uint32 event type, index
+ *   RecFetch        uint32 index, int8 eol, with eol 0 followed by a sink: one
+ *                   call of sink_fetch_cb(), the answer to a debounced fetch
+ * where a sink is uint32 index, volume, base volume, uint8 channels, mute,
+ * string name, description and a string is a length byte followed by that
+ * many bytes. */
+#define RECORD_MAGIC "daudio-record 1\n"
+enum { RecServerInfo = 1, RecSinkInfo, RecSinkListEnd, RecSubscribe, RecFetch };
+
+static FILE *record_file = NULL;
+static pa_usec_t record_last;
+static pa_defer_event *flush_event = NULL;
+
+static unsigned char *replay_buf = NULL;
+static size_t replay_len = 0, replay_pos = 0;
+static int replay_realtime, replay_finished = 0;
+static pa_usec_t replay_start, replay_t;
+
+/* The last recorded answer to a fetch of each sink that no replayed fetch
+ * took yet. A fetch is answered with the newest one, as the server would. */
+typedef struct {
+    uint32_t index;
+    int complete;   /* the eol call was read too */
+    int8_t eol;
+    int has_info;
+    pa_sink_info info;
+    char name[sizeof(((PulseSink *) 0)->name)];
+    char description[sizeof(((PulseSink *) 0)->description)];
+} ReplayAnswer;
+
+static ReplayAnswer *answers = NULL;
+static int answers_count = 0, answers_cap = 0;
 
-static char default_sink_name[sizeof(sinks->name)];
-static PulseSink *default_sink = NULL;
 
-static int dirty = 0;
+void context_state_callback(pa_context *c, void *userdata);
+static void publish_cb(pa_mainloop_api *a, pa_defer_event *e, void *userdata);
+static void flush_cb(pa_mainloop_api *a, pa_defer_event *e, void *userdata);
+static void replay_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata);
+static size_t replay_skip(size_t pos);
+
+/* Logs every callback to path from now on, must be called before setup_pulse(). */
+void pulse_record(const char *path) {
+    if (!(record_file = fopen(path, "wb"))) {
+        die("fopen %s:", path);
+    }
+    fputs(RECORD_MAGIC, record_file);
+}
 
-static pthread_mutex_t lock;
+/* Feeds a recording to the callbacks instead of connecting to a server, in
+ * the recorded timing or, without realtime, one record per mainloop
+ * iteration. Must be called before setup_pulse(). */
+void pulse_replay(const char *path, int realtime) {
+    FILE *f;
+    size_t cap = 0, pos, end;
 
+    if (!(f = fopen(path, "rb"))) {
+        die("fopen %s:", path);
+    }
+    /* read it all up front, so the disk does not show up in the timing */
+    do {
+        if (replay_len == cap && !(replay_buf = realloc(replay_buf, (cap = cap ? cap * 2 : 65536)))) {
+            die("realloc:");
+        }
+        replay_len += fread(replay_buf + replay_len, 1, cap - replay_len, f);
+    } while (replay_len == cap);
+    fclose(f);
+    if (replay_len < strlen(RECORD_MAGIC) || memcmp(replay_buf, RECORD_MAGIC, strlen(RECORD_MAGIC))) {
+        die("%s is not a daudio recording", path);
+    }
+    /* a recorder that was killed leaves a partial record behind */
+    for (pos = strlen(RECORD_MAGIC); pos < replay_len && (end = replay_skip(pos)); pos = end);
+    if (pos < replay_len) {
+        fprintf(stderr, "%s ends in a partial record, replaying the ones before it\n", path);
+        replay_len = pos;
+    }
+    replay_pos = strlen(RECORD_MAGIC);
+    replay_realtime = realtime;
+}
 
-void context_state_callback(pa_context *c, void *userdata);
+/* true once the whole recording was fed to the callbacks */
+int pulse_replay_done() {
+    return __atomic_load_n(&replay_finished, __ATOMIC_SEQ_CST);
+}
+
+static void rec_bytes(const void *p, size_t n) {
+    fwrite(p, 1, n, record_file);
+}
+
+static void rec_u32(uint32_t v) {
+    rec_bytes(&v, sizeof(v));
+}
+
+static void rec_str(const char *str) {
+    uint8_t n = (uint8_t) MIN(strlen(str), 255);
 
-int setup_pulse() {
+    rec_bytes(&n, 1);
+    rec_bytes(str, n);
+}
+
+static void rec_start(uint8_t type) {
+    pa_usec_t now = pa_rtclock_now();
+
+    rec_bytes(&type, 1);
+    rec_u32((uint32_t) MIN(now - record_last, UINT32_MAX));
+    record_last = now;
+    api->defer_enable(flush_event, 1);
+}
+
+static void rec_sink(const pa_sink_info *sink_info) {
+    rec_u32(sink_info->index);
+    rec_u32(sink_info->volume.values[0]);
+    rec_u32(sink_info->base_volume);
+    rec_bytes(&sink_info->volume.channels, 1);
+    rec_bytes(&(uint8_t) {sink_info->mute != 0}, 1);
+    rec_str(sink_info->name);
+    rec_str(sink_info->description ? sink_info->description : "");
+}
+
+/* Once per mainloop iteration with new records, so a recorder that is killed
+ * loses at most the callbacks of the iteration it was killed in. */
+static void flush_cb(pa_mainloop_api *a, pa_defer_event *e, void *userdata) {
+    api->defer_enable(e, 0);
+    if (fflush(record_file) == EOF) {
+        die("write recording:");
+    }
+}
+
+static int pulse_setup(int fetch_delay_ms) {
 
     if (context)
         return -1;
 
-    if (pthread_mutex_init(&lock, NULL) != 0) {
-        die("pthread_mutex_init() has failed");
+    fetch_delay = (pa_usec_t) fetch_delay_ms * PA_USEC_PER_MSEC;
+
+    if ((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        die("eventfd:");
     }
 
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ready_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
     threaded_mainloop = pa_threaded_mainloop_new();
 
     api = pa_threaded_mainloop_get_api(threaded_mainloop);
 
+    sinks_publish(0);
+    publish_event = api->defer_new(api, publish_cb, NULL);
+    api->defer_enable(publish_event, 0);
+    if (record_file) {
+        flush_event = api->defer_new(api, flush_cb, NULL);
+        api->defer_enable(flush_event, 0);
+        record_last = pa_rtclock_now();
+    }
+
+    if (replay_buf) {
+        struct timeval tv;
+
+        replay_start = pa_rtclock_now();
+        api->time_new(api, pa_timeval_rtstore(&tv, replay_start, 1), replay_cb, NULL);
+        pa_threaded_mainloop_start(threaded_mainloop);
+        return 0;
+    }
+
     pa_proplist *proplist = pa_proplist_new();
     pa_proplist_sets(proplist, PA_PROP_APPLICATION_NAME, "daudio");
     pa_proplist_sets(proplist, PA_PROP_APPLICATION_ID, "daudio");
@@ -68,103 +252,305 @@ int setup_pulse() {
     return 0;
 }
 
-int free_pulse() {
+static int pulse_free(void) {
     pa_threaded_mainloop_stop(threaded_mainloop);
     pa_threaded_mainloop_free(threaded_mainloop);
-    pthread_mutex_destroy(&lock);
-    free(sinks);
+    if (wake_fd >= 0)
+        close(wake_fd);
+    if (record_file && fclose(record_file) == EOF)
+        fprintf(stderr, "could not write the recording\n");
+    record_file = NULL;
+    sinks_free();
+    free(pending);
+    free(replay_buf);
+    replay_buf = NULL;
+    free(answers);
+    answers = NULL;
+    answers_count = answers_cap = 0;
     return 0;
 }
 
-void updated_default_sink() {
-    for (int i = 0; i < sink_count; ++i) {
-        if (strcmp(sinks[i].name, default_sink_name) == 0) {
-            default_sink = &sinks[i];
-            break;
-        }
+/* Wakes up the ui thread blocked in poll on wake_fd. */
+static void notify_update() {
+    uint64_t one = 1;
+
+    /* a full counter already wakes the ui thread */
+    if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        die("write wake fd:");
     }
 }
 
-PulseSink *get_or_add_sink(uint32_t index){
-    for (PulseSink *sink = sinks; sink < sinks+sink_count; ++sink) {
-        if (sink->index == index) {
-            return sink;
-        }
+/* Runs once per mainloop iteration after a change, so a burst of callbacks
+ * (the initial sink list, a device reconnecting) becomes one snapshot. */
+static void publish_cb(pa_mainloop_api *a, pa_defer_event *e, void *userdata) {
+    api->defer_enable(e, 0);
+    sinks_publish(default_sink);
+    notify_update();
+
+    if (ready == ReadyAll && !ready_published) {
+        pthread_mutex_lock(&ready_mutex);
+        ready_published = 1;
+        pthread_cond_broadcast(&ready_cond);
+        pthread_mutex_unlock(&ready_mutex);
     }
-    sink_count++;
-    sinks = realloc(sinks,  sizeof(*sinks) * sink_count);
-    return &sinks[sink_count - 1];
 }
 
-void remove_sink(uint32_t index) {
-    for (int i = 0; i < sink_count; ++i) {
-        if (sinks[i].index == index) {
-            sink_count--;
-            memmove(&sinks[i], &sinks[i+1], sink_count - i);
-            sinks = realloc(sinks,  sizeof(*sinks) * sink_count);
-            return;
-        }
+static void state_changed() {
+    api->defer_enable(publish_event, 1);
+}
+
+static void op_sent(pa_operation *o) {
+    if (o) {
+        ops_in_flight++;
+    } else {
+        ops_failed++;
     }
 }
 
-void server_info_cb(pa_context *c, const pa_server_info *server_info, void *userdata) {
-    pulse_lock();
+static void op_done(int success) {
+    ops_in_flight--;
+    if (!success) {
+        ops_failed++;
+    }
+    if (ops_in_flight == 0) {
+        pa_threaded_mainloop_signal(threaded_mainloop, 0);
+    }
+}
+
+void updated_default_sink() {
+    default_sink = sinks_find_name(default_sink_name);
+}
 
-    dirty++;
+void remove_sink(uint32_t index) {
+    SinkHandle h = sinks_find(index);
+    PulseSink *sink = sinks_get(h);
+
+    if (!sink) {
+        return;
+    }
+    /* nobody is left to take the completion of these */
+    if (sink->volume_op) {
+        pa_operation_cancel(sink->volume_op);
+        pa_operation_unref(sink->volume_op);
+        op_done(0);
+    }
+    if (sink->mute_op) {
+        pa_operation_cancel(sink->mute_op);
+        pa_operation_unref(sink->mute_op);
+        op_done(0);
+    }
+    sinks_remove(h);
+}
 
+void server_info_cb(pa_context *c, const pa_server_info *server_info, void *userdata) {
     if (!server_info) {
         fprintf(stderr, "Server info callback failure");
-        pulse_unlock();
         return;
     }
+    if (record_file) {
+        rec_start(RecServerInfo);
+        rec_str(server_info->default_sink_name ? server_info->default_sink_name : "");
+    }
 
     strlcpy(default_sink_name, server_info->default_sink_name ? server_info->default_sink_name : "",
             sizeof(default_sink_name));
 
     updated_default_sink();
-    pulse_unlock();
+    ready |= ReadyServerInfo;
+    state_changed();
 }
 
-void sink_info_cb(pa_context *c, const pa_sink_info *sink_info, int eol, void *userdata) {
-    pulse_lock();
-
-    dirty++;
+static void update_sink(const pa_sink_info *sink_info) {
+    SinkHandle h = sinks_add(sink_info->index);
+    PulseSink *sink = sinks_get(h);
+    sinks_set_name(h, sink_info->name);
+    strlcpy(sink->description, sink_info->description, sizeof(sink->description));
+    /* while our own change is in flight the server still reports the old
+     * value, keep the optimistic one until the last operation completed */
+    if (!sink->volume_op) {
+        sink->volume = sink_info->volume.values[0];
+    }
+    if (!sink->mute_op) {
+        sink->mute = sink_info->mute;
+    }
+    sink->base_volume = sink_info->base_volume;
+    sink->channels = sink_info->volume.channels;
+    if (!default_sink) {
+        updated_default_sink();
+    }
+    state_changed();
+}
 
+/* The initial sink list, fetches go through sink_fetch_cb. */
+void sink_info_cb(pa_context *c, const pa_sink_info *sink_info, int eol, void *userdata) {
+    if (record_file && eol == 0) {
+        rec_start(RecSinkInfo);
+        rec_sink(sink_info);
+    } else if (record_file && eol == 1) {
+        rec_start(RecSinkListEnd);
+    }
     if (eol != 0) {
         if (eol == 1) {
             updated_default_sink();
+            ready |= ReadySinkList;
+            state_changed();
         }
-        pulse_unlock();
         return;
-    };
-    PulseSink *sink = get_or_add_sink(sink_info->index);
-    strlcpy(sink->name, sink_info->name, sizeof(sink->name));
-    strlcpy(sink->description, sink_info->description, sizeof(sink->description));
-    sink->index = sink_info->index;
-    sink->volume = sink_info->volume.values[0];
-    sink->base_volume = sink_info->base_volume;
-    sink->mute = sink_info->mute;
-    sink->channels = sink_info->volume.channels;
-    pulse_unlock();
+    }
+    update_sink(sink_info);
+}
+
+static PendingFetch *find_pending(uint32_t index) {
+    for (int i = 0; i < pending_count; i++) {
+        if (pending[i].index == index) {
+            return &pending[i];
+        }
+    }
+    return NULL;
+}
+
+static void drop_pending(PendingFetch *p) {
+    *p = pending[--pending_count];
+}
+
+static void fetch_timer_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata);
+
+static void arm_fetch_timer() {
+    struct timeval tv;
+
+    if (fetch_timer_armed) {
+        return;
+    }
+    pa_timeval_rtstore(&tv, pa_rtclock_now() + fetch_delay, 1);
+    if (fetch_timer) {
+        api->time_restart(fetch_timer, &tv);
+    } else {
+        fetch_timer = api->time_new(api, &tv, fetch_timer_cb, NULL);
+    }
+    fetch_timer_armed = 1;
+}
+
+/* Completion of a debounced fetch. Events that arrived while it was in
+ * flight get one more fetch, since the reply may predate them. */
+static void sink_fetch_cb(pa_context *c, const pa_sink_info *sink_info, int eol, void *userdata) {
+    PendingFetch *p = find_pending((uint32_t) (uintptr_t) userdata);
+
+    if (record_file) {
+        rec_start(RecFetch);
+        rec_u32((uint32_t) (uintptr_t) userdata);
+        rec_bytes(&(int8_t) {(int8_t) MAX(MIN(eol, 1), -1)}, 1);
+        if (eol == 0) {
+            rec_sink(sink_info);
+        }
+    }
+    if (eol == 0) {
+        /* the sink was removed while we asked for it, do not resurrect it */
+        if (!p || p->state != FetchRemoved) {
+            update_sink(sink_info);
+        }
+        return;
+    }
+    if (!p) {
+        return;
+    }
+    if (p->state == FetchInFlightDirty) {
+        p->state = FetchScheduled;
+        arm_fetch_timer();
+    } else {
+        drop_pending(p);
+    }
+}
+
+static void replay_answer_fetches();
+static void replay_check_finished();
+
+static void fetch_timer_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata) {
+    pa_operation *o;
+
+    fetch_timer_armed = 0;
+    for (int i = 0; i < pending_count; i++) {
+        if (pending[i].state != FetchScheduled) {
+            continue;
+        }
+        if (!context) {
+            /* a replay, the answer is in the recording */
+            pending[i].state = FetchInFlight;
+            stats.fetches++;
+            continue;
+        }
+        if (!(o = pa_context_get_sink_info_by_index(context, pending[i].index, sink_fetch_cb,
+                                                    (void *) (uintptr_t) pending[i].index))) {
+            fprintf(stderr, "pa_context_get_sink_info_by_index() failed");
+            drop_pending(&pending[i--]);
+            continue;
+        }
+        pa_operation_unref(o);
+        pending[i].state = FetchInFlight;
+        stats.fetches++;
+    }
+    if (!context) {
+        replay_answer_fetches();
+        replay_check_finished();
+    }
+}
+
+static void schedule_fetch(uint32_t index) {
+    PendingFetch *p = find_pending(index);
+
+    if (p) {
+        if (p->state != FetchScheduled) {
+            p->state = FetchInFlightDirty;
+        }
+        return;
+    }
+    if (pending_count == pending_cap) {
+        pending_cap = pending_cap ? pending_cap * 2 : 8;
+        if (!(pending = realloc(pending, sizeof(*pending) * pending_cap))) {
+            die("realloc:");
+        }
+    }
+    pending[pending_count].index = index;
+    pending[pending_count].state = FetchScheduled;
+    pending_count++;
+    arm_fetch_timer();
+}
+
+static void unschedule_fetch(uint32_t index) {
+    PendingFetch *p = find_pending(index);
+
+    if (!p) {
+        return;
+    }
+    if (p->state == FetchScheduled) {
+        drop_pending(p);
+    } else {
+        p->state = FetchRemoved;
+    }
 }
 
 void subscribe_cb(pa_context *c, pa_subscription_event_type_t t, uint32_t index, void *userdata) {
+    if (record_file) {
+        rec_start(RecSubscribe);
+        rec_u32(t);
+        rec_u32(index);
+    }
 
     switch (t & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) {
         case PA_SUBSCRIPTION_EVENT_SINK:
-            if ((t & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_REMOVE)
+            stats.events++;
+            if ((t & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_REMOVE) {
+                unschedule_fetch(index);
                 remove_sink(index);
-            else {
-                pa_operation *o;
-                if (!(o = pa_context_get_sink_info_by_index(c, index, sink_info_cb, NULL))) {
-                    fprintf(stderr, "pa_context_get_sink_info_list() failed");
-                    return;
-                }
-                pa_operation_unref(o);
+                state_changed();
+            } else {
+                schedule_fetch(index);
             }
             break;
         case PA_SUBSCRIPTION_EVENT_SERVER: {
             pa_operation *o;
+            if (!context) {
+                return;
+            }
             if (!(o = pa_context_get_server_info(c, server_info_cb, NULL))) {
                 fprintf(stderr, "pa_context_get_server_info() failed");
                 return;
@@ -223,48 +609,398 @@ void context_state_callback(pa_context *c, void *userdata) {
     }
 }
 
-void set_volume(const PulseSink *sink, pa_volume_t volume) {
+static void volume_done_cb(pa_context *c, int success, void *userdata);
+static void mute_done_cb(pa_context *c, int success, void *userdata);
+
+static void send_volume(PulseSink *sink) {
     pa_cvolume cvolume;
-    pa_cvolume_set(&cvolume, sink->channels, volume);
-    pa_context_set_sink_volume_by_index(context, sink->index, &cvolume, NULL, NULL);
+
+    /* nobody to send to in a replay, the local value stays */
+    if (!context) {
+        return;
+    }
+    pa_cvolume_set(&cvolume, sink->channels, sink->volume);
+    sink->sent_volume = sink->volume;
+    sink->volume_op = pa_context_set_sink_volume_by_index(context, sink->index, &cvolume, volume_done_cb,
+                                                          (void *) (uintptr_t) sink->handle);
+    op_sent(sink->volume_op);
+}
+
+static void send_mute(PulseSink *sink) {
+    if (!context) {
+        return;
+    }
+    sink->sent_mute = sink->mute;
+    sink->mute_op = pa_context_set_sink_mute_by_index(context, sink->index, sink->mute, mute_done_cb,
+                                                      (void *) (uintptr_t) sink->handle);
+    op_sent(sink->mute_op);
+}
+
+/* Completion of a set volume operation. If the target moved on while it was
+ * in flight, the latest target is sent, older ones are never queued. */
+static void volume_done_cb(pa_context *c, int success, void *userdata) {
+    PulseSink *sink = sinks_get((SinkHandle) (uintptr_t) userdata);
+
+    if (!sink || !sink->volume_op) {
+        return;
+    }
+    pa_operation_unref(sink->volume_op);
+    sink->volume_op = NULL;
+    if (sink->volume != sink->sent_volume) {
+        send_volume(sink);
+    }
+    op_done(success);
+}
+
+static void mute_done_cb(pa_context *c, int success, void *userdata) {
+    PulseSink *sink = sinks_get((SinkHandle) (uintptr_t) userdata);
+
+    if (!sink || !sink->mute_op) {
+        return;
+    }
+    pa_operation_unref(sink->mute_op);
+    sink->mute_op = NULL;
+    if (sink->mute != sink->sent_mute) {
+        send_mute(sink);
+    }
+    op_done(success);
+}
+
+/* Sets the optimistic local volume right away, at most one operation per sink
+ * is in flight. Must be called with pulse_lock() held. */
+static void pulse_set_volume(const PulseSink *target, pa_volume_t volume) {
+    PulseSink *sink = sinks_get(target->handle);
+
+    if (!sink) {
+        return;
+    }
+    sink->volume = volume;
+    if (!sink->volume_op) {
+        send_volume(sink);
+    }
+    /* publish right away, the caller is about to draw the optimistic value */
+    sinks_publish(default_sink);
+}
+
+static void pulse_set_mute(const PulseSink *target, uint8_t mute) {
+    PulseSink *sink = sinks_get(target->handle);
+
+    if (!sink) {
+        return;
+    }
+    sink->mute = mute;
+    if (!sink->mute_op) {
+        send_mute(sink);
+    }
+    sinks_publish(default_sink);
+}
+
+static void default_done_cb(pa_context *c, int success, void *userdata) {
+    op_done(success);
+}
+
+static void pulse_set_default_sink(const PulseSink *sink) {
+    pa_operation *o;
+
+    if (!context) {
+        return;
+    }
+    o = pa_context_set_default_sink(context, sink->name, default_done_cb, NULL);
+
+    op_sent(o);
+    if (o) {
+        pa_operation_unref(o);
+    }
+}
+
+/* Blocks until the server acknowledged every operation sent so far. Must be
+ * called with pulse_lock() held. Returns the number of failed operations. */
+static int pulse_wait_ops(void) {
+    while (ops_in_flight > 0) {
+        pa_threaded_mainloop_wait(threaded_mainloop);
+    }
+    return ops_failed;
+}
+
+static const PulseSink *pulse_default_sink(void) {
+    return sinks_get(default_sink);
+}
+
+static const PulseStats *pulse_stats(void) {
+    return &stats;
+}
+
+static int pulse_fd(void) {
+    return wake_fd;
+}
+
+/* Blocks until the initial state is published, without polling.
+ * Returns -1 if that takes longer than timeout_ms. */
+static int pulse_wait_ready(int timeout_ms) {
+    struct timespec deadline;
+    int err = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    timespecAddMs(&deadline, timeout_ms);
+
+    pthread_mutex_lock(&ready_mutex);
+    while (!ready_published && err != ETIMEDOUT) {
+        err = pthread_cond_timedwait(&ready_cond, &ready_mutex, &deadline);
+    }
+    err = ready_published ? 0 : -1;
+    pthread_mutex_unlock(&ready_mutex);
+    return err;
 }
 
-void set_mute(const PulseSink *sink, uint8_t mute) {
-    pa_context_set_sink_mute_by_index(context, sink->index, mute, NULL, NULL);
+/* The callbacks run in the mainloop thread with this lock held, so it guards
+ * the live sink table and every pa_context call made from the ui thread.
+ * Drawing reads published snapshots and does not need it. */
+static void pulse_mainloop_lock(void) {
+    pa_threaded_mainloop_lock(threaded_mainloop);
 }
+static void pulse_mainloop_unlock(void) {
+    pa_threaded_mainloop_unlock(threaded_mainloop);
+}
+
+static const unsigned char *replay_read(size_t n) {
+    const unsigned char *p = replay_buf + replay_pos;
 
-void set_default_sink(const PulseSink* sink) {
-    pa_context_set_default_sink(context, sink->name, NULL, NULL);
+    if (replay_pos + n > replay_len) {
+        die("replay: truncated recording");
+    }
+    replay_pos += n;
+    return p;
 }
 
-const PulseSink *get_sinks() {
-    return sinks;
+static uint32_t replay_u32() {
+    uint32_t v;
+
+    memcpy(&v, replay_read(sizeof(v)), sizeof(v));
+    return v;
 }
 
-int get_sinks_count() {
-    return sink_count;
+static void replay_str(char *dst, size_t size) {
+    size_t n = *replay_read(1);
+    const unsigned char *p = replay_read(n);
+
+    n = MIN(n, size - 1);
+    memcpy(dst, p, n);
+    dst[n] = '\0';
 }
 
-const PulseSink *get_default_sink()  {
-    return default_sink;
+/* Offset after the string or sink at pos, 0 if the recording ends in it. */
+static size_t replay_skip_str(size_t pos) {
+    return pos < replay_len && pos + 1 + replay_buf[pos] <= replay_len ? pos + 1 + replay_buf[pos] : 0;
+}
+
+static size_t replay_skip_sink(size_t pos) {
+    pos += 3 * sizeof(uint32_t) + 2;
+    return (pos = replay_skip_str(pos)) ? replay_skip_str(pos) : 0;
+}
+
+/* Offset after the record at pos, 0 if the recording ends in it. */
+static size_t replay_skip(size_t pos) {
+    uint8_t type;
+
+    if (pos + 1 + sizeof(uint32_t) > replay_len) {
+        return 0;
+    }
+    type = replay_buf[pos];
+    pos += 1 + sizeof(uint32_t);
+    switch (type) {
+        case RecServerInfo:
+            return replay_skip_str(pos);
+        case RecSinkInfo:
+            return replay_skip_sink(pos);
+        case RecSinkListEnd:
+            return pos;
+        case RecSubscribe:
+            return pos + 2 * sizeof(uint32_t) <= replay_len ? pos + 2 * sizeof(uint32_t) : 0;
+        case RecFetch:
+            if (pos + sizeof(uint32_t) + 1 > replay_len) {
+                return 0;
+            }
+            pos += sizeof(uint32_t) + 1;
+            return replay_buf[pos - 1] ? pos : replay_skip_sink(pos);
+        default:
+            die("replay: unknown record type %d", type);
+            return 0;
+    }
+}
+
+/* µs after the start of the replay the next record is due */
+static pa_usec_t replay_next_due() {
+    uint32_t dt;
+
+    if (replay_pos + 1 + sizeof(dt) > replay_len) {
+        die("replay: truncated recording");
+    }
+    memcpy(&dt, replay_buf + replay_pos + 1, sizeof(dt));
+    return replay_t + dt;
+}
+
+static void replay_sink(pa_sink_info *sink, char *name, char *description) {
+    pa_volume_t volume;
+    uint8_t channels;
+
+    sink->index = replay_u32();
+    volume = replay_u32();
+    sink->base_volume = replay_u32();
+    channels = *replay_read(1);
+    sink->mute = *replay_read(1);
+    replay_str(name, sizeof(((PulseSink *) 0)->name));
+    replay_str(description, sizeof(((PulseSink *) 0)->description));
+    if (!channels || channels > PA_CHANNELS_MAX) {
+        die("replay: invalid channel count %d", channels);
+    }
+    pa_cvolume_set(&sink->volume, channels, volume);
+    sink->name = name;
+    sink->description = description;
+}
+
+/* Keeps a recorded sink_fetch_cb() call as the newest answer for its sink,
+ * until the replay has a fetch in flight for it. */
+static void replay_fetch() {
+    ReplayAnswer *a = NULL;
+    uint32_t index = replay_u32();
+    int8_t eol = (int8_t) *replay_read(1);
+
+    for (int i = 0; i < answers_count; i++) {
+        if (answers[i].index == index) {
+            a = &answers[i];
+        }
+    }
+    if (!a) {
+        if (answers_count == answers_cap) {
+            answers_cap = answers_cap ? answers_cap * 2 : 8;
+            if (!(answers = realloc(answers, sizeof(*answers) * answers_cap))) {
+                die("realloc:");
+            }
+        }
+        a = &answers[answers_count++];
+        a->index = index;
+        a->complete = a->has_info = 0;
+    }
+    /* the first call of a newer answer replaces the older one */
+    if (a->complete) {
+        a->complete = 0;
+        a->has_info = 0;
+    }
+    if (eol == 0) {
+        replay_sink(&a->info, a->name, a->description);
+        a->has_info = 1;
+        return;
+    }
+    a->eol = eol;
+    a->complete = 1;
+    replay_answer_fetches();
 }
 
-const int get_dirty() {
-    return dirty;
+/* Hands complete answers to the fetches in flight for their sink. */
+static void replay_answer_fetches() {
+    PendingFetch *p;
+    ReplayAnswer a;
+
+    for (int i = 0; i < answers_count; i++) {
+        if (!answers[i].complete || !(p = find_pending(answers[i].index)) || p->state == FetchScheduled) {
+            continue;
+        }
+        a = answers[i];
+        a.info.name = a.name;
+        a.info.description = a.description;
+        answers[i--] = answers[--answers_count];
+        if (a.has_info) {
+            sink_fetch_cb(NULL, &a.info, 0, (void *) (uintptr_t) a.index);
+        }
+        sink_fetch_cb(NULL, NULL, a.eol, (void *) (uintptr_t) a.index);
+    }
 }
 
-void set_dirty(int new_dirty) {
-    pulse_lock();
-    dirty = new_dirty;
-    pulse_unlock();
+/* The replay is over after the last record, once no fetch waits for the
+ * timer. Fetches still in flight then are never answered. */
+static void replay_check_finished() {
+    if (replay_pos < replay_len || pulse_replay_done()) {
+        return;
+    }
+    for (int i = 0; i < pending_count; i++) {
+        if (pending[i].state == FetchScheduled) {
+            return;
+        }
+    }
+    __atomic_store_n(&replay_finished, 1, __ATOMIC_SEQ_CST);
+    notify_update();
 }
 
-void pulse_lock() {
-    pthread_mutex_lock(&lock);
+/* Calls the callback the record was logged by, with the recorded payload.
+ * Fetches are the exception, they are answered when the replay asks. */
+static void replay_record() {
+    char name[sizeof(((PulseSink *) 0)->name)], description[sizeof(((PulseSink *) 0)->description)];
+    pa_server_info server = {0};
+    pa_sink_info sink = {0};
+    uint8_t type = *replay_read(1);
+    uint32_t t;
+
+    replay_t += replay_u32();
+    switch (type) {
+        case RecServerInfo:
+            replay_str(name, sizeof(name));
+            server.default_sink_name = name;
+            server_info_cb(NULL, &server, NULL);
+            break;
+        case RecSinkInfo:
+            replay_sink(&sink, name, description);
+            sink_info_cb(NULL, &sink, 0, NULL);
+            break;
+        case RecSinkListEnd:
+            sink_info_cb(NULL, NULL, 1, NULL);
+            break;
+        case RecSubscribe:
+            t = replay_u32();
+            subscribe_cb(NULL, (pa_subscription_event_type_t) t, replay_u32(), NULL);
+            break;
+        case RecFetch:
+            replay_fetch();
+            break;
+        default:
+            die("replay: unknown record type %d", type);
+    }
 }
-void pulse_unlock() {
-    pthread_mutex_unlock(&lock);
+
+/* Records logged in one go are replayed in one go, like the callbacks of
+ * one mainloop iteration. */
+static void replay_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata) {
+    struct timeval next;
+
+    while (replay_pos < replay_len) {
+        replay_record();
+        if (replay_pos == replay_len || !replay_realtime || replay_start + replay_next_due() > pa_rtclock_now()) {
+            break;
+        }
+    }
+    if (replay_pos == replay_len) {
+        a->time_free(e);
+        replay_check_finished();
+        return;
+    }
+    a->time_restart(e, pa_timeval_rtstore(&next, replay_realtime ? replay_start + replay_next_due()
+                                                                 : pa_rtclock_now(), 1));
 }
 
+const AudioBackend pulse_backend = {
+    .name = "pulse",
+    .setup = pulse_setup,
+    .free = pulse_free,
+    .set_volume = pulse_set_volume,
+    .set_mute = pulse_set_mute,
+    .set_default_sink = pulse_set_default_sink,
+    .wait_ready = pulse_wait_ready,
+    .wait_ops = pulse_wait_ops,
+    .default_sink = pulse_default_sink,
+    .lock = pulse_mainloop_lock,
+    .unlock = pulse_mainloop_unlock,
+    .stats = pulse_stats,
+    .fd = pulse_fd,
+};
+
 
 #endif //DAUDIO_PULSEAUDIO_C
@@ -14,7 +14,10 @@
 #include "util.h"
 
 
+typedef uint32_t SinkHandle; /* 0 is no sink, see sinks.h */
+
 typedef struct PulseSink {
+    SinkHandle handle;
     uint32_t index;
     char name[128];
     char description[128];
@@ -22,10 +25,61 @@ typedef struct PulseSink {
     pa_volume_t base_volume;
     uint8_t mute;
     uint8_t channels;
+    /* in flight set operations and the values they carry, volume and mute
+     * above are the optimistic local values while these are pending */
+    pa_operation *volume_op, *mute_op;
+    pa_volume_t sent_volume;
+    uint8_t sent_mute;
 } PulseSink;
 
+/* Immutable snapshot of the audio state, published by the pulse thread. */
+typedef struct PulseState {
+    unsigned long generation;  /* increases with every published change */
+    int sinks_count;
+    int default_sink;          /* position in sinks, -1 if unknown */
+    struct PulseState *next;
+    PulseSink sinks[];
+} PulseState;
+
+
+typedef struct {
+    unsigned long events;   /* sink subscription events received */
+    unsigned long fetches;  /* get_sink_info requests issued for them */
+} PulseStats;
+
+
+/* An audio backend owns the sink table (sinks.h) and publishes snapshots of
+ * it. Everything except setup and free runs under its lock, callbacks of the
+ * backend thread included. The functions below dispatch to the selected one. */
+typedef struct {
+    const char *name;
+    int (*setup)(int fetch_delay_ms);
+    int (*free)(void);
+    void (*set_volume)(const PulseSink *sink, pa_volume_t volume);
+    void (*set_mute)(const PulseSink *sink, uint8_t mute);
+    void (*set_default_sink)(const PulseSink *sink);
+    int (*wait_ready)(int timeout_ms);
+    int (*wait_ops)(void);
+    const PulseSink *(*default_sink)(void);
+    void (*lock)(void);
+    void (*unlock)(void);
+    const PulseStats *(*stats)(void);
+    int (*fd)(void);
+} AudioBackend;
+
+extern const AudioBackend pulse_backend;  /* libpulse, pulseaudio.c */
+extern const AudioBackend mock_backend;   /* in process, see mock.h */
 
-int setup_pulse();
+/* must be called before setup_pulse(), pulse_backend by default */
+void use_backend(const AudioBackend *b);
+
+/* pulse_backend only, see pulseaudio.c */
+void pulse_record(const char *path);
+void pulse_replay(const char *path, int realtime);
+int pulse_replay_done();
+
+
+int setup_pulse(int fetch_delay_ms);
 
 int free_pulse();
 
@@ -33,13 +87,17 @@ void set_volume(const PulseSink *sink, pa_volume_t volume);
 void set_mute(const PulseSink *sink, uint8_t mute);
 void set_default_sink(const PulseSink* sink);
 
-const PulseSink *get_sinks();
-int get_sinks_count();
+int wait_for_pulse(int timeout_ms);
+int wait_for_ops();
+
 const PulseSink *get_default_sink();
+const PulseState *get_state();
 
 void pulse_lock();
 void pulse_unlock();
 
+const PulseStats *get_pulse_stats();
+
+/* readable whenever the pulse thread published a new state */
+int get_pulse_fd();
 
-const int get_dirty();
-void set_dirty(int dirty);
@@ -0,0 +1,61 @@
+/* See LICENSE file for copyright and license details. */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdint.h>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+
+#include "roundtrip.h"
+#include "util.h"
+
+/* Xlib and the generated xcb_*_reply() functions wait for their replies in
+ * one of the two functions below, which are interposed here. A wait is a
+ * round trip if something was written to the server since the last one, so
+ * replies to requests sent together are counted once. */
+
+static unsigned long roundtrips;
+static uint64_t written;
+
+unsigned long
+roundtrip_count(void)
+{
+	return roundtrips;
+}
+
+static void
+waited(xcb_connection_t *c)
+{
+	uint64_t w = xcb_total_written(c);
+
+	if (w != written) {
+		written = w;
+		roundtrips++;
+	}
+}
+
+void *
+xcb_wait_for_reply(xcb_connection_t *c, unsigned int request, xcb_generic_error_t **e)
+{
+	static void *(*real)(xcb_connection_t *, unsigned int, xcb_generic_error_t **);
+	void *reply;
+
+	/* the cast of dlsym(3), ISO C has no conversion to function pointers */
+	if (!real && !(*(void **)&real = dlsym(RTLD_NEXT, "xcb_wait_for_reply")))
+		die("dlsym xcb_wait_for_reply: %s", dlerror());
+	reply = real(c, request, e);
+	waited(c);
+	return reply;
+}
+
+void *
+xcb_wait_for_reply64(xcb_connection_t *c, uint64_t request, xcb_generic_error_t **e)
+{
+	static void *(*real)(xcb_connection_t *, uint64_t, xcb_generic_error_t **);
+	void *reply;
+
+	if (!real && !(*(void **)&real = dlsym(RTLD_NEXT, "xcb_wait_for_reply64")))
+		die("dlsym xcb_wait_for_reply64: %s", dlerror());
+	reply = real(c, request, e);
+	waited(c);
+	return reply;
+}
@@ -0,0 +1,7 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Round trips to the X server since the start of the process: every wait for
+ * a reply after requests were sent, whether daudio, Xlib or Xft waited. Xlib
+ * sits on top of xcb, so both builds are counted the same way. */
+
+unsigned long roundtrip_count(void);
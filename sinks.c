@@ -0,0 +1,336 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pulseaudio.h"
+#include "sinks.h"
+
+#define CHUNK_SIZE  32
+/* A handle is the slot + 1 in the low SLOT_BITS and the generation above.
+ * Slots retire once their generation is used up instead of wrapping to 0,
+ * which would make stale handles valid again. */
+#define SLOT_BITS   20
+#define SLOT_MAX    ((1u << SLOT_BITS) - 1)
+#define GEN_MAX     ((1u << (32 - SLOT_BITS)) - 1)
+#define SLOT(h)     (((h) & SLOT_MAX) - 1)
+#define GEN(h)      ((h) >> SLOT_BITS)
+#define HANDLE(s, g) (((uint32_t) (g) << SLOT_BITS) | ((s) + 1))
+
+typedef struct {
+    PulseSink sink;
+    int pos;        /* position in order, -1 while the slot is free */
+    uint16_t gen;
+    uint32_t next_free;
+} Slot;
+
+/* open addressing with linear probing, cap is a power of two */
+typedef struct {
+    struct {
+        uint32_t hash;
+        SinkHandle h;
+    } *e;
+    size_t cap, len;
+} Index;
+
+static Slot **chunks = NULL;
+static size_t chunk_count = 0;
+static uint32_t free_slot = UINT32_MAX;
+static uint32_t slot_count = 0;
+
+static PulseSink **order = NULL;
+static int order_len = 0, order_cap = 0;
+
+static Index by_index, by_name;
+
+/* Published snapshots. The writer always holds the pulse lock, the one reader
+ * (the ui thread) announces the snapshot it is using in hazard, everything
+ * else that was replaced is freed on the next publish. */
+static PulseState *current = NULL;
+static PulseState *hazard = NULL;
+static PulseState *retired = NULL;
+static unsigned long generation = 0;
+
+static Slot *slot_at(uint32_t s) {
+    return &chunks[s / CHUNK_SIZE][s % CHUNK_SIZE];
+}
+
+static uint32_t hash_index(uint32_t index) {
+    return index * 0x9E3779B1u;
+}
+
+static uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u;
+
+    for (; *name; name++) {
+        hash = (hash ^ (unsigned char) *name) * 16777619u;
+    }
+    return hash;
+}
+
+static void index_insert(Index *ix, uint32_t hash, SinkHandle h);
+
+static void index_grow(Index *ix) {
+    Index old = *ix;
+
+    ix->cap = old.cap ? old.cap * 2 : 64;
+    ix->len = 0;
+    ix->e = ecalloc(ix->cap, sizeof(*ix->e));
+    for (size_t i = 0; i < old.cap; i++) {
+        if (old.e[i].h) {
+            index_insert(ix, old.e[i].hash, old.e[i].h);
+        }
+    }
+    free(old.e);
+}
+
+static void index_insert(Index *ix, uint32_t hash, SinkHandle h) {
+    size_t i;
+
+    if ((ix->len + 1) * 2 > ix->cap) {
+        index_grow(ix);
+    }
+    for (i = hash & (ix->cap - 1); ix->e[i].h; i = (i + 1) & (ix->cap - 1))
+        ;
+    ix->e[i].hash = hash;
+    ix->e[i].h = h;
+    ix->len++;
+}
+
+/* Removes h, shifting later entries of the probe sequence back instead of
+ * leaving tombstones. */
+static void index_remove(Index *ix, uint32_t hash, SinkHandle h) {
+    size_t i, j, k, mask = ix->cap - 1;
+
+    if (!ix->cap) {
+        return;
+    }
+    for (i = hash & mask; ix->e[i].h != h; i = (i + 1) & mask) {
+        if (!ix->e[i].h) {
+            return;
+        }
+    }
+    for (j = i;;) {
+        j = (j + 1) & mask;
+        if (!ix->e[j].h) {
+            break;
+        }
+        k = ix->e[j].hash & mask;
+        /* the entry at j may move to i unless its home k lies cyclically in (i, j] */
+        if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+            ix->e[i] = ix->e[j];
+            i = j;
+        }
+    }
+    ix->e[i].h = 0;
+    ix->len--;
+}
+
+SinkHandle sinks_add(uint32_t index) {
+    SinkHandle h;
+    uint32_t s;
+    Slot *slot;
+
+    if ((h = sinks_find(index))) {
+        return h;
+    }
+
+    if (free_slot != UINT32_MAX) {
+        s = free_slot;
+        free_slot = slot_at(s)->next_free;
+    } else {
+        if (slot_count == SLOT_MAX) {
+            die("sinks: out of handles");
+        }
+        if (slot_count == chunk_count * CHUNK_SIZE) {
+            if (!(chunks = realloc(chunks, sizeof(*chunks) * (chunk_count + 1)))) {
+                die("realloc:");
+            }
+            chunks[chunk_count++] = ecalloc(CHUNK_SIZE, sizeof(Slot));
+        }
+        s = slot_count++;
+    }
+    slot = slot_at(s);
+    memset(&slot->sink, 0, sizeof(slot->sink));
+    slot->sink.index = index;
+    h = HANDLE(s, slot->gen);
+
+    if (order_len == order_cap) {
+        order_cap = order_cap ? order_cap * 2 : 16;
+        if (!(order = realloc(order, sizeof(*order) * order_cap))) {
+            die("realloc:");
+        }
+    }
+    slot->pos = order_len;
+    order[order_len++] = &slot->sink;
+
+    slot->sink.handle = h;
+    /* the name is indexed once sinks_set_name() gives it one */
+    index_insert(&by_index, hash_index(index), h);
+    return h;
+}
+
+void sinks_remove(SinkHandle h) {
+    PulseSink *sink = sinks_get(h);
+    Slot *slot;
+
+    if (!sink) {
+        return;
+    }
+    slot = slot_at(SLOT(h));
+    index_remove(&by_index, hash_index(sink->index), h);
+    if (sink->name[0]) {
+        index_remove(&by_name, hash_name(sink->name), h);
+    }
+
+    /* keep the remaining sinks in order, this only moves pointers */
+    memmove(&order[slot->pos], &order[slot->pos + 1], sizeof(*order) * (order_len - slot->pos - 1));
+    order_len--;
+    for (int i = slot->pos; i < order_len; i++) {
+        ((Slot *) order[i])->pos = i;
+    }
+
+    slot->pos = -1;
+    if (++slot->gen > GEN_MAX) {
+        return;
+    }
+    slot->next_free = free_slot;
+    free_slot = SLOT(h);
+}
+
+void sinks_set_name(SinkHandle h, const char *name) {
+    PulseSink *sink = sinks_get(h);
+
+    if (!sink || strcmp(sink->name, name) == 0) {
+        return;
+    }
+    if (sink->name[0]) {
+        index_remove(&by_name, hash_name(sink->name), h);
+    }
+    strlcpy(sink->name, name, sizeof(sink->name));
+    if (sink->name[0]) {
+        index_insert(&by_name, hash_name(sink->name), h);
+    }
+}
+
+void sinks_free(void) {
+    PulseState *state;
+
+    while ((state = retired)) {
+        retired = state->next;
+        free(state);
+    }
+    free(current);
+    current = hazard = NULL;
+    for (size_t i = 0; i < chunk_count; i++) {
+        free(chunks[i]);
+    }
+    free(chunks);
+    free(order);
+    free(by_index.e);
+    free(by_name.e);
+    chunks = NULL;
+    order = NULL;
+    chunk_count = slot_count = 0;
+    order_len = order_cap = 0;
+    free_slot = UINT32_MAX;
+    memset(&by_index, 0, sizeof(by_index));
+    memset(&by_name, 0, sizeof(by_name));
+}
+
+PulseSink *sinks_get(SinkHandle h) {
+    Slot *slot;
+
+    if (!h || SLOT(h) >= slot_count) {
+        return NULL;
+    }
+    slot = slot_at(SLOT(h));
+    return slot->pos >= 0 && slot->gen == GEN(h) ? &slot->sink : NULL;
+}
+
+SinkHandle sinks_find(uint32_t index) {
+    uint32_t hash = hash_index(index);
+    size_t i, mask = by_index.cap - 1;
+
+    if (!by_index.cap) {
+        return 0;
+    }
+    for (i = hash & mask; by_index.e[i].h; i = (i + 1) & mask) {
+        if (by_index.e[i].hash == hash && sinks_get(by_index.e[i].h)->index == index) {
+            return by_index.e[i].h;
+        }
+    }
+    return 0;
+}
+
+SinkHandle sinks_find_name(const char *name) {
+    uint32_t hash = hash_name(name);
+    size_t i, mask = by_name.cap - 1;
+
+    if (!by_name.cap) {
+        return 0;
+    }
+    for (i = hash & mask; by_name.e[i].h; i = (i + 1) & mask) {
+        if (by_name.e[i].hash == hash && strcmp(sinks_get(by_name.e[i].h)->name, name) == 0) {
+            return by_name.e[i].h;
+        }
+    }
+    return 0;
+}
+
+int sinks_count(void) {
+    return order_len;
+}
+
+PulseSink *sinks_at(int i) {
+    return i >= 0 && i < order_len ? order[i] : NULL;
+}
+
+static void reclaim(void) {
+    PulseState **p = &retired, *state;
+    PulseState *pinned = __atomic_load_n(&hazard, __ATOMIC_SEQ_CST);
+
+    while ((state = *p)) {
+        if (state == pinned) {
+            p = &state->next;
+        } else {
+            *p = state->next;
+            free(state);
+        }
+    }
+}
+
+/* Copies the table into a new immutable snapshot and swaps it in. */
+void sinks_publish(SinkHandle default_sink) {
+    PulseState *state = ecalloc(1, sizeof(*state) + sizeof(PulseSink) * order_len);
+    PulseState *old;
+
+    state->generation = ++generation;
+    state->sinks_count = order_len;
+    state->default_sink = -1;
+    for (int i = 0; i < order_len; i++) {
+        state->sinks[i] = *order[i];
+        if (order[i]->handle == default_sink) {
+            state->default_sink = i;
+        }
+    }
+
+    old = __atomic_exchange_n(&current, state, __ATOMIC_SEQ_CST);
+    if (old) {
+        old->next = retired;
+        retired = old;
+    }
+    reclaim();
+}
+
+/* Returns the latest snapshot without taking any lock. It stays valid until
+ * the next call, which may free it. Only one thread may read. */
+const PulseState *sinks_state(void) {
+    PulseState *state;
+
+    do {
+        state = __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&hazard, state, __ATOMIC_SEQ_CST);
+    } while (state != __atomic_load_n(&current, __ATOMIC_SEQ_CST));
+    return state;
+}
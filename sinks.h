@@ -0,0 +1,22 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Sink table: PulseSink records live in fixed chunks and never move, so
+ * pointers and handles stay valid until the sink is removed. Handles carry
+ * a generation and go stale instead of pointing at a reused slot. Lookups by
+ * pa index and by name are O(1), iteration follows insertion order. */
+
+SinkHandle sinks_add(uint32_t index);
+void sinks_remove(SinkHandle h);
+void sinks_set_name(SinkHandle h, const char *name);
+void sinks_free(void);
+
+PulseSink *sinks_get(SinkHandle h);
+SinkHandle sinks_find(uint32_t index);
+SinkHandle sinks_find_name(const char *name);
+
+int sinks_count(void);
+PulseSink *sinks_at(int i);
+
+/* Snapshots for a single lock-free reader, see sinks.c */
+void sinks_publish(SinkHandle default_sink);
+const PulseState *sinks_state(void);
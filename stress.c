@@ -0,0 +1,372 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Event storm: a second thread adds, changes and removes sinks at a fixed
+ * rate while the ui loop draws every published snapshot and moves the volume
+ * like a held key. Runs on the mock backend, or with -p against a running
+ * pulseaudio, where null sinks are loaded and unloaded with pactl. Only those
+ * sinks, named daudio-stress.n, are touched: the first one is the default
+ * sink for the run, the previous default comes back at the end.
+ *
+ *   daudio-stress [-p] [-t seconds] [-r events/s] [-n sinks]
+ *   daudio-stress -replay file [-f] [-t seconds]
+ *
+ * With -replay, a recording of daudio -record takes the place of the storm,
+ * as fast as possible with -f, in its original timing otherwise, until it
+ * ends or the time is up.
+ *
+ * prints key=value lines: event throughput, the time the ui waited for and
+ * held the backend lock, and draw() times, in µs. Frames are drawn by the
+ * software renderer, X is not needed. */
+
+#include "headless.h"
+#include <stdarg.h>
+#include "sinks.h"
+
+typedef struct {
+	double *v;
+	size_t n, cap;
+} Samples;
+
+static const AudioBackend *inner;
+static AudioBackend timed;
+static struct timespec lock_start;
+static int lock_depth;
+static Samples lock_wait, lock_hold, frame_times;
+
+static int use_pulse;
+static uint32_t *present; /* per sink slot, 1 or with -p the module */
+static char previous_default[128];
+static const char *replay;
+static int replay_fast;
+
+static const char stress_usage[] =
+	"usage: daudio-stress [-p] [-t seconds] [-r events/s] [-n sinks]\n"
+	"       daudio-stress -replay file [-f] [-t seconds]";
+static int seconds = 5, rate = 5000, max_sinks = 64;
+static int stop;
+static unsigned long injected;
+
+static double
+since_us(struct timespec *start)
+{
+	struct timespec now, d;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespec_diff(&d, &now, start);
+	return d.tv_sec * 1e6 + d.tv_nsec / 1e3;
+}
+
+static void
+sample(Samples *s, double v)
+{
+	if (s->n == s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 1024;
+		if (!(s->v = realloc(s->v, s->cap * sizeof(double))))
+			die("realloc:");
+	}
+	s->v[s->n++] = v;
+}
+
+static int
+cmpdouble(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+report(const char *name, Samples *s)
+{
+	if (!s->n) {
+		printf("stress %s n=0\n", name);
+		return;
+	}
+	qsort(s->v, s->n, sizeof(double), cmpdouble);
+	printf("stress %s n=%zu p50=%.1f p90=%.1f p99=%.1f max=%.1f\n", name, s->n,
+	       s->v[s->n / 2], s->v[s->n * 9 / 10], s->v[s->n * 99 / 100], s->v[s->n - 1]);
+	free(s->v);
+}
+
+/* the ui side of the backend lock, timed */
+static void
+timed_lock(void)
+{
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	inner->lock();
+	if (lock_depth++ == 0) {
+		sample(&lock_wait, since_us(&start));
+		clock_gettime(CLOCK_MONOTONIC, &lock_start);
+	}
+}
+
+static void
+timed_unlock(void)
+{
+	if (--lock_depth == 0)
+		sample(&lock_hold, since_us(&lock_start));
+	inner->unlock();
+}
+
+/* xorshift, the same storm every run */
+static uint32_t
+next_random(void)
+{
+	static uint32_t x = 2463534242u;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+static int
+stress_sink(const PulseSink *sink)
+{
+	return sink && !strncmp(sink->name, "daudio-stress.", strlen("daudio-stress."));
+}
+
+static void
+pactl(char *out, size_t size, const char *fmt, ...)
+{
+	char command[128];
+	va_list ap;
+	FILE *f;
+
+	va_start(ap, fmt);
+	vsnprintf(command, sizeof(command), fmt, ap);
+	va_end(ap);
+	if (!(f = popen(command, "r")))
+		die("popen:");
+	if (!out || !fgets(out, size, f))
+		while (fgetc(f) != EOF)
+			; /* NOP */
+	if (pclose(f))
+		die("%s failed", command);
+	if (out)
+		out[strcspn(out, "\n")] = '\0';
+}
+
+/* the first null sink is there before daudio starts and stays the default */
+static void
+pulse_start(void)
+{
+	char id[32];
+
+	pactl(previous_default, sizeof(previous_default), "pactl get-default-sink");
+	pactl(id, sizeof(id), "pactl load-module module-null-sink sink_name=daudio-stress.0");
+	present[0] = strtoul(id, NULL, 10);
+	pactl(NULL, 0, "pactl set-default-sink daudio-stress.0");
+}
+
+/* also runs from atexit, after a die() as well, so it must not die itself */
+static void
+pulse_restore(void)
+{
+	char command[192];
+
+	if (previous_default[0]) {
+		snprintf(command, sizeof(command), "pactl set-default-sink '%s'", previous_default);
+		if (system(command))
+			fprintf(stderr, "daudio-stress: cannot restore the default sink %s\n", previous_default);
+		previous_default[0] = '\0';
+	}
+	for (int i = 0; present && i < max_sinks; i++) {
+		if (present[i]) {
+			snprintf(command, sizeof(command), "pactl unload-module %u", present[i]);
+			if (system(command))
+				fprintf(stderr, "daudio-stress: cannot unload module %u\n", present[i]);
+			present[i] = 0;
+		}
+	}
+}
+
+/* Pulse only reports changes made on the server: volumes are set through the
+ * backend, sinks come from module-null-sink. Modules are slow to load, so
+ * at most one add or remove happens per 20 ms. */
+static void
+pulse_event(uint32_t *modules, int i, int change)
+{
+	static struct timespec last;
+	char id[32];
+	PulseSink *sink;
+
+	/* snapshots are for the ui thread, this one reads the live table */
+	if (change || since_us(&last) < 20000) {
+		if (!modules[i])
+			return;
+		snprintf(id, sizeof(id), "daudio-stress.%d", i);
+		inner->lock();
+		if ((sink = sinks_get(sinks_find_name(id))))
+			set_volume(sink, PA_VOLUME_NORM / 100 * (next_random() % 100));
+		inner->unlock();
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &last);
+	if (modules[i]) {
+		pactl(NULL, 0, "pactl unload-module %u", modules[i]);
+		modules[i] = 0;
+	} else {
+		pactl(id, sizeof(id), "pactl load-module module-null-sink sink_name=daudio-stress.%d", i);
+		modules[i] = strtoul(id, NULL, 10);
+	}
+}
+
+static void *
+inject(void *arg)
+{
+	struct timespec tick;
+	int i, k, count = 0, per_ms = MAX(rate / 1000, 1);
+	MockEvent ev;
+
+	/* the initial sinks of the mock backend */
+	for (i = 0; !use_pulse && i < MIN(max_sinks, 8); i++, count++)
+		present[i] = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &tick);
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		for (k = 0; k < per_ms; k++, injected++) {
+			i = next_random() % max_sinks;
+			/* mostly changes, the last sink is never removed, nor
+			 * with -p the default one */
+			int change = next_random() % 10 < 7 || (present[i] && count == 1);
+			if (use_pulse) {
+				change |= i == 0;
+				pulse_event(present, i, change);
+				continue;
+			}
+			ev.index = i;
+			if (change && present[i]) {
+				ev.type = next_random() % 4 ? MockVolume : MockMute;
+				ev.value = ev.type == MockVolume ? PA_VOLUME_NORM / 100 * (next_random() % 100)
+				                                 : next_random() % 2;
+			} else {
+				ev.type = present[i] ? MockRemove : MockAdd;
+				count += present[i] ? -1 : 1;
+				present[i] = !present[i];
+			}
+			mock_inject(&ev);
+		}
+		timespecAddMs(&tick, 1);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tick, NULL);
+	}
+	return NULL;
+}
+
+static void
+interrupt(int sig)
+{
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct timespec start, frame, last_key;
+	const PulseState *s;
+	struct pollfd pfd;
+	unsigned long events, generations = 0;
+	uint64_t count;
+	pthread_t injector;
+	int ended = 0;
+	double elapsed;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-p"))
+			use_pulse = 1;
+		else if (!strcmp(argv[i], "-f"))
+			replay_fast = 1;
+		else if (i + 1 == argc)
+			die("%s", stress_usage);
+		else if (!strcmp(argv[i], "-t"))
+			seconds = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-r"))
+			rate = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-n"))
+			max_sinks = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-replay"))
+			replay = argv[++i];
+		else
+			die("%s", stress_usage);
+	}
+	if (replay_fast && !replay)
+		die("%s", stress_usage);
+	max_sinks = MAX(max_sinks, 1);
+	present = ecalloc(max_sinks, sizeof(uint32_t));
+
+	headless_setup();
+	/* ^C ends the run early, with the report and the cleanup */
+	signal(SIGINT, interrupt);
+	if (use_pulse) {
+		if (atexit(pulse_restore))
+			die("cannot set exit function");
+		pulse_start();
+	}
+
+	if (replay)
+		pulse_replay(replay, !replay_fast);
+	inner = use_pulse || replay ? &pulse_backend : &mock_backend;
+	timed = *inner;
+	timed.lock = timed_lock;
+	timed.unlock = timed_unlock;
+	use_backend(&timed);
+	mock_configure(MIN(max_sinks, 8), mock_latency);
+	/* a replay starts with the initial sink list, that counts too */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	setup_pulse(sink_fetch_delay);
+	wait_for_default_sink();
+	update_selected_sink();
+	draw();
+
+	if (!replay && pthread_create(&injector, NULL, inject, NULL))
+		die("pthread_create:");
+	pfd.fd = get_pulse_fd();
+	pfd.events = POLLIN;
+	if (!replay)
+		clock_gettime(CLOCK_MONOTONIC, &start);
+	clock_gettime(CLOCK_MONOTONIC, &last_key);
+	/* one more round after the end of a replay, for its last snapshot */
+	while (!ended && !__atomic_load_n(&stop, __ATOMIC_RELAXED) && since_us(&start) < seconds * 1e6) {
+		ended = replay && pulse_replay_done();
+		if (poll(&pfd, 1, 5) > 0 && read(pfd.fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			die("read:");
+		/* a held key repeats about every 30 ms */
+		if (since_us(&last_key) >= 30000) {
+			clock_gettime(CLOCK_MONOTONIC, &last_key);
+			pulse_lock();
+			/* pulse picks a real output if ours goes away */
+			if (!use_pulse || stress_sink(get_default_sink()))
+				hold_volume_key(1);
+			pulse_unlock();
+		}
+		if ((s = get_state())->generation != drawn_generation) {
+			generations += s->generation - drawn_generation;
+			clock_gettime(CLOCK_MONOTONIC, &frame);
+			draw();
+			sample(&frame_times, since_us(&frame));
+		}
+	}
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	if (!replay)
+		pthread_join(injector, NULL);
+	elapsed = since_us(&start) / 1e6;
+
+	pulse_lock();
+	events = get_pulse_stats()->events;
+	pulse_unlock();
+	printf("stress backend=%s seconds=%.2f injected=%lu events=%lu events/s=%.0f "
+	       "publishes=%lu frames=%lu\n", inner->name, elapsed, injected, events,
+	       events / elapsed, generations, frames);
+	report("lock_wait_us", &lock_wait);
+	report("lock_hold_us", &lock_hold);
+	report("frame_us", &frame_times);
+
+	headless_cleanup();
+	if (use_pulse)
+		pulse_restore();
+	free(present);
+	present = NULL;
+	return 0;
+}